@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "cam_detect.h"
+#include "profile.h"
+#include "bench.h"
+
+// Synthetic frame sizes, smallest to largest
+static const int synthetic_sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160} };
+#define NUM_SYNTHETIC_SIZES (int)(sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]))
+
+// Everything kept from one benchmarked frame to the next, as batch mode does
+typedef struct {
+    ThresholdEngine engine;
+    ThreadPool* pool;
+    RegionTable regions;
+    DetectionList detections;
+    Bmp threshold_image;
+    Bmp image_with_regions;
+    const CalibrationStore* store;
+    char threshold_path[STR_BUFFER_SIZE];
+    char regions_path[STR_BUFFER_SIZE];
+} BenchContext;
+
+// Small deterministic generator so synthetic frames are the same every run
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Fully saturated, full value colour of a hue (0-360) as file order bytes
+static void hue_colour(int hue, unsigned char* pixel) {
+    int sector = (hue / 60) % 6;
+    unsigned char rising = (unsigned char)((hue % 60) * 255 / 60);
+    unsigned char falling = 255 - rising;
+    unsigned char red[] = {255, falling, 0, 0, rising, 255};
+    unsigned char green[] = {rising, 255, 255, falling, 0, 0};
+    unsigned char blue[] = {0, 0, rising, 255, 255, falling};
+    pixel[RED] = red[sector];
+    pixel[GREEN] = green[sector];
+    pixel[BLUE] = blue[sector];
+}
+
+// Write a synthetic frame: dark noise with discs in the calibrated hues and a few others
+static void write_synthetic_frame(char* path, int width, int height, const CalibrationStore* store) {
+    int num_calibrations = store->num_objects;
+    Bmp image = create_bmp(width, height);
+    uint32_t seed = SYNTHETIC_SEED;
+
+    for (int y = 0; y < height; y++) {
+        unsigned char* pixel = bmp_pixel(image, 0, y);
+        for (int x = 0; x < width; x++, pixel += BYTES_PER_PIXEL) {
+            uint32_t noise = next_random(&seed);
+            pixel[RED] = noise & 0x3F;
+            pixel[GREEN] = (noise >> 6) & 0x3F;
+            pixel[BLUE] = (noise >> 12) & 0x3F;
+        }
+    }
+
+    int num_blobs = (width * height) / SYNTHETIC_PIXELS_PER_BLOB + 1;
+    int max_radius = ((width < height) ? width : height) / 12 + 2;
+    for (int blob = 0; blob < num_blobs; blob++) {
+        int centre_x = next_random(&seed) % width;
+        int centre_y = next_random(&seed) % height;
+        int radius = 4 + next_random(&seed) % max_radius;
+        int pick = next_random(&seed) % (num_calibrations + 1);
+        int hue = (pick < num_calibrations) ? store->objects[pick].ranges[0].hue_mid : (int)(next_random(&seed) % 360);
+        unsigned char colour[BYTES_PER_PIXEL];
+        hue_colour(hue, colour);
+
+        for (int y = centre_y - radius; y <= centre_y + radius; y++) {
+            for (int x = centre_x - radius; x <= centre_x + radius; x++) {
+                int inside = (x - centre_x) * (x - centre_x) + (y - centre_y) * (y - centre_y) <= radius * radius;
+                if (inside && x >= 0 && x < width && y >= 0 && y < height) {
+                    memcpy(bmp_pixel(image, x, y), colour, BYTES_PER_PIXEL);
+                }
+            }
+        }
+    }
+
+    write_bmp(image, path);
+    free_bmp(image);
+}
+
+// Detect objects in one image, timing each stage; returns the number of detections
+static int detect_timed(BenchContext* context, char* image_path, StageTimes* times, unsigned int* width, unsigned int* height) {
+    start_frame_times(times);
+
+    double start = clock_seconds();
+    Bmp image_bmp = read_bmp_populated(image_path);
+    record_stage(times, STAGE_READ, clock_seconds() - start);
+
+    start = clock_seconds();
+    context->threshold_image = add_planes(reuse_bmp(image_bmp, context->threshold_image));
+    threshold_rows(context->pool, &context->engine, image_bmp, context->threshold_image);
+    record_stage(times, STAGE_THRESHOLD, clock_seconds() - start);
+
+    start = clock_seconds();
+    threshold_and_label(context->pool, NULL, image_bmp, context->threshold_image, &context->regions);
+    record_stage(times, STAGE_LABEL, clock_seconds() - start);
+
+    start = clock_seconds();
+    context->image_with_regions = reuse_bmp(image_bmp, context->image_with_regions);
+    memcpy(context->image_with_regions.pixels, image_bmp.pixels, (size_t)image_bmp.stride * image_bmp.height);
+    int num_detections = collect_detections(context->store, &context->regions, &context->image_with_regions, &context->detections);
+    record_stage(times, STAGE_CLASSIFY, clock_seconds() - start);
+
+    start = clock_seconds();
+    write_bmp(context->threshold_image, context->threshold_path);
+    write_bmp(context->image_with_regions, context->regions_path);
+    record_stage(times, STAGE_WRITE, clock_seconds() - start);
+
+    *width = image_bmp.width;
+    *height = image_bmp.height;
+    free_bmp(image_bmp);
+    return num_detections;
+}
+
+// Benchmark one image and print its JSON object
+static void bench_image(BenchContext* context, char* image_path, char* name, int iterations, int first) {
+    StageTimes times = create_stage_times(iterations);
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    // One untimed run so page faults and first-touch allocations are not counted
+    detect_timed(context, image_path, NULL, &width, &height);
+
+    unsigned long allocations = allocation_count();
+    int num_detections = 0;
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        num_detections = detect_timed(context, image_path, &times, &width, &height);
+    }
+    double allocations_per_frame = (double)(allocation_count() - allocations) / iterations;
+
+    double megapixels = (double)width * height / 1e6;
+    printf("%s    {\"name\": ", first ? "" : ",\n");
+    print_json_string(stdout, name);
+    printf(", \"width\": %u, \"height\": %u, \"megapixels\": %.4f, \"detections\": %d, \"allocations_per_frame\": %.2f,\n",
+           width, height, megapixels, num_detections, allocations_per_frame);
+    printf("     \"stages\": ");
+    print_stage_json(stdout, &times, megapixels);
+    printf("}");
+    free_stage_times(&times);
+}
+
+void bench_mode(char* calibration_file_path, int num_threads, int iterations) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
+
+    char directory[] = BENCH_DIRECTORY_TEMPLATE;
+    if (mkdtemp(directory) == NULL) {
+        fprintf(stderr, "Could not create benchmark directory\n");
+        exit(1);
+    }
+
+    BenchContext context;
+    memset(&context, 0, sizeof(context));
+    context.engine = create_threshold_engine(calibration_file_path, &store, KERNEL_AUTO);
+    context.pool = create_thread_pool(num_threads);
+    context.regions = create_region_table();
+    context.detections = create_detection_list();
+    context.store = &store;
+    snprintf(context.threshold_path, STR_BUFFER_SIZE, "%s/threshold_output.bmp", directory);
+    snprintf(context.regions_path, STR_BUFFER_SIZE, "%s/image_with_regions.bmp", directory);
+
+    char** image_paths = NULL;
+    int num_images = list_bmp_files(DEFAULT_IMAGE_DIRECTORY, &image_paths);
+
+    printf("{\n  \"kernel\": \"%s\", \"threads\": %d, \"iterations\": %d,\n  \"images\": [\n",
+           threshold_kernel_name(context.engine.kernel_type), thread_pool_size(context.pool), iterations);
+    for (int i = 0; i < num_images; i++) {
+        bench_image(&context, image_paths[i], image_paths[i], iterations, i == 0);
+    }
+    for (int size = 0; size < NUM_SYNTHETIC_SIZES; size++) {
+        char path[STR_BUFFER_SIZE];
+        char name[STR_BUFFER_SIZE];
+        int width = synthetic_sizes[size][0];
+        int height = synthetic_sizes[size][1];
+        snprintf(path, sizeof(path), "%s/synthetic_%dx%d.bmp", directory, width, height);
+        snprintf(name, sizeof(name), "synthetic %dx%d", width, height);
+        write_synthetic_frame(path, width, height, &store);
+        bench_image(&context, path, name, iterations, num_images == 0 && size == 0);
+        unlink(path);
+    }
+    printf("\n  ],\n  \"peak_rss_kb\": %ld, \"allocations\": %lu\n}\n", peak_rss_kb(), allocation_count());
+
+    unlink(context.threshold_path);
+    unlink(context.regions_path);
+    rmdir(directory);
+
+    free_path_list(image_paths, num_images);
+    if (context.threshold_image.header != NULL) {
+        free_bmp(context.threshold_image);
+    }
+    if (context.image_with_regions.header != NULL) {
+        free_bmp(context.image_with_regions);
+    }
+    free_detection_list(&context.detections);
+    free_region_table(&context.regions);
+    free_thread_pool(context.pool);
+    free_threshold_engine(context.engine);
+    free_calibration_store(store);
+}
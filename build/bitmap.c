@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "bitmap.h"
 #include "cam_detect.h"
@@ -15,6 +20,10 @@
 #define HEIGHT_OFFSET 0x16
 #define PIXEL_SIZE_OFFSET 0x1C
 #define DATA_SIZE_OFFSET 0x22
+#define INFO_HEADER_SIZE_OFFSET 0x0E
+#define PLANES_OFFSET 0x1A
+#define INFO_HEADER_SIZE 40 // BITMAPINFOHEADER
+#define PIXEL_ALIGNMENT 64  // Pixel buffers are aligned to a cache line
 
 RGB white = {255, 255, 255};    // RGB Value for white
 RGB black = {0, 0, 0};          // RGB Value for black
@@ -29,9 +38,23 @@ typedef struct {
     uint32_t data_size;
 
     uint8_t *raw;
+
+    // File mapping that raw and the pixels point into (NULL if they were allocated)
+    void *mapping;
+    size_t mapping_size;
+
+    // Heap copy of a whole file that raw and the pixels point into (NULL if none)
+    void *buffer;
 } BmpHeader;
 
 
+// Allocate an aligned pixel buffer of (at least) size bytes
+static unsigned char *alloc_pixels(size_t size) {
+    // aligned_alloc needs the size to be a multiple of the alignment
+    size_t padded_size = (size + PIXEL_ALIGNMENT - 1) / PIXEL_ALIGNMENT * PIXEL_ALIGNMENT;
+    return aligned_alloc(PIXEL_ALIGNMENT, padded_size);
+}
+
 void check_fp(FILE *fp, char *filename) {
     if(fp == NULL) {
         fprintf(stderr, "Could not open file %s\n", filename);
@@ -39,6 +62,13 @@ void check_fp(FILE *fp, char *filename) {
     }
 }
 
+void check_fd(int fd, char *filename) {
+    if(fd < 0) {
+        fprintf(stderr, "Could not open file %s\n", filename);
+        exit(1);
+    }
+}
+
 void assert_file_format(bool condition) {
     if (!condition) {
         fprintf(stderr, "File format error\n");
@@ -46,97 +76,128 @@ void assert_file_format(bool condition) {
     }
 }
 
-Bmp read_bmp(char *filename) {
-
-    FILE *fp = fopen(filename, "r");
-    check_fp(fp, filename);
+// Build a Bmp whose header and pixel rows point straight into data,
+// which holds a complete file of size bytes (nothing is copied)
+static Bmp parse_bmp(uint8_t *data, size_t size) {
 
     // Struct to return results
     Bmp bmp;
     bmp.header = malloc(sizeof(BmpHeader));
+    assert_file_format(bmp.header != NULL);
     BmpHeader *header = bmp.header;
+    header->mapping = NULL;
+    header->mapping_size = 0;
+    header->buffer = NULL;
 
-    // Read in standard header
-    uint8_t standard_header[BMP_HEADER_SIZE];
-    size_t bytes_read = fread(standard_header, 1, BMP_HEADER_SIZE, fp);
-    assert_file_format(bytes_read == BMP_HEADER_SIZE);
+    // Check standard header
+    assert_file_format(size >= BMP_HEADER_SIZE);
+    uint8_t *standard_header = data;
 
     // Check file type
     assert_file_format(standard_header[0] == 'B' && standard_header[1] == 'M');
-    //printf("%x\t%x\n", standard_header, *(uint32_t *)(standard_header + SIZE_OFFSET));
 
-    header->file_size = *((uint32_t *)(standard_header + SIZE_OFFSET));
-    header->pixel_array_offset =  *((uint32_t *)(standard_header + PIXEL_ARRAY_OFFSET));
+    memcpy(&header->file_size, standard_header + SIZE_OFFSET, sizeof(uint32_t));
+    memcpy(&header->pixel_array_offset, standard_header + PIXEL_ARRAY_OFFSET, sizeof(uint32_t));
 
-    header->pixel_size = *((uint16_t *)(standard_header + PIXEL_SIZE_OFFSET)); // Pi
+    memcpy(&header->pixel_size, standard_header + PIXEL_SIZE_OFFSET, sizeof(uint16_t));
     assert_file_format(header->pixel_size == 24);
 
-    header->width =  *((uint32_t *)(standard_header + WIDTH_OFFSET));
-    header->height =  *((uint32_t *)(standard_header + HEIGHT_OFFSET));
+    memcpy(&header->width, standard_header + WIDTH_OFFSET, sizeof(uint32_t));
+    memcpy(&header->height, standard_header + HEIGHT_OFFSET, sizeof(uint32_t));
 
-    header->row_size = ((header->pixel_size * header->width + 31) / 32) * 4;
+    // Sizes are worked out in 64 bits so a crafted header cannot wrap them
+    uint64_t row_size = ((uint64_t)header->pixel_size * header->width + 31) / 32 * 4;
+    assert_file_format(row_size <= UINT32_MAX);
+    header->row_size = (uint32_t)row_size;
 
     #ifdef DEBUG
     printf("Row size %u\n",header->row_size);
     #endif
 
-    header->data_size = *((uint32_t *)(standard_header + 0x22));
+    memcpy(&header->data_size, standard_header + DATA_SIZE_OFFSET, sizeof(uint32_t));
+    assert_file_format((uint64_t)header->data_size + header->pixel_array_offset == header->file_size);
+    assert_file_format(header->file_size <= size);
+    assert_file_format(header->pixel_array_offset <= size);
 
-    // Read in entire header (everything but pixel array)
-    rewind(fp);
-    header->raw = malloc(sizeof(unsigned char) * header->pixel_array_offset);
-    assert_file_format(header->raw != NULL);
-    bytes_read = fread(header->raw, 1, header->pixel_array_offset, fp);
+    // Entire header (everything but pixel array) stays where it is
+    header->raw = data;
 
-    // Read in rest of file
-    char *raw_image = malloc(header->data_size);
-    bytes_read = fread(raw_image, 1, header->data_size, fp);
-    assert_file_format(bytes_read == header->data_size);
+    // Pixel rows are used in place: bottom-up, padded to row_size bytes
+    bmp.stride = header->row_size;
+    uint64_t image_size = row_size * header->height;
+    assert_file_format(header->data_size >= image_size);
+    assert_file_format(image_size <= size - header->pixel_array_offset);
+    bmp.pixels = data + header->pixel_array_offset;
 
-    // Allocate columns
-    bmp.pixels = malloc(header->height * sizeof(unsigned char **));
-    for (unsigned int i = 0; i < header->height; i++) {
+    // ADDED BY DYLAN
+    // Only threshold images need side planes (see add_planes)
+    bmp.height = header->height;
+    bmp.width = header->width;
+    bmp.region = NULL;
+    bmp.object_type = NULL;
 
-        // Allocate rows
-        bmp.pixels[i] = malloc(header->width * sizeof(unsigned char *));
-        assert_file_format(bmp.pixels[i] != NULL);
+    return bmp;
+}
 
-        for (unsigned int j = 0; j < header->width; j++) {
+// Maps a file privately so the pixels can be modified without touching the file
+static Bmp map_bmp(char *filename, int extra_flags) {
 
-            // Allocate pixels
-            bmp.pixels[i][j] = malloc(6 * sizeof(unsigned char));   // Changed to store 5 values per pixel by Dylan
-            assert_file_format(bmp.pixels[i][j] != NULL);
-        }
-    }
+    int fd = open(filename, O_RDONLY);
+    check_fd(fd, filename);
 
-    // Read in each pixel
-    for (unsigned int y = 0; y < header->height; y++) {
-        for (unsigned int x = 0; x < header->width; x++) {
-            
-            // Read in each pixel
-            bmp.pixels[y][x][BLUE] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 0));
-            bmp.pixels[y][x][GREEN] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 1));
-            bmp.pixels[y][x][RED] = *((unsigned char *)(raw_image + y * header->row_size + header->pixel_size/8 * x + 2));
-
-            // ADDED BY DYLAN
-            bmp.pixels[y][x][PIXEL_REGION_INDEX] = 0;  // Initialise region value to -1 (unsigned region)
-            bmp.pixels[y][x][VISITED_INDEX] = 0;        // Initialise visited value to 0 (not visited)
-            bmp.pixels[y][x][OBJECT_TYPE_INDEX] = 0;    // Initialise object type to 0
-        }
-    }
+    struct stat file_info;
+    assert_file_format(fstat(fd, &file_info) == 0 && file_info.st_size >= BMP_HEADER_SIZE);
+    size_t size = (size_t)file_info.st_size;
 
-    free(raw_image);
-    fclose(fp);
-    assert_file_format(header->data_size + header->pixel_array_offset == header->file_size);
-
-    // Write height and width inside output bmp wrapper
-    bmp.height = header->height;
-    bmp.width = header->width;
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | extra_flags, fd, 0);
+    close(fd);
+    assert_file_format(mapping != MAP_FAILED);
+    madvise(mapping, size, MADV_SEQUENTIAL);
 
+    Bmp bmp = parse_bmp(mapping, size);
+    BmpHeader *header = bmp.header;
+    header->mapping = mapping;
+    header->mapping_size = size;
 
     return bmp;
 }
 
+Bmp read_bmp(char *filename) {
+    return map_bmp(filename, 0);
+}
+
+Bmp read_bmp_populated(char *filename) {
+    return map_bmp(filename, MAP_POPULATE);
+}
+
+bool read_bmp_stream(FILE *stream, Bmp *bmp) {
+
+    // A clean end of stream before the next file starts ends the sequence
+    uint8_t standard_header[BMP_HEADER_SIZE];
+    size_t header_read = fread(standard_header, 1, BMP_HEADER_SIZE, stream);
+    if (header_read == 0 && feof(stream)) {
+        return false;
+    }
+    assert_file_format(header_read == BMP_HEADER_SIZE);
+    assert_file_format(standard_header[0] == 'B' && standard_header[1] == 'M');
+
+    uint32_t file_size;
+    memcpy(&file_size, standard_header + SIZE_OFFSET, sizeof(uint32_t));
+    assert_file_format(file_size >= BMP_HEADER_SIZE);
+
+    // Read the rest of this file into one buffer and use it in place
+    uint8_t *data = malloc(file_size);
+    assert_file_format(data != NULL);
+    memcpy(data, standard_header, BMP_HEADER_SIZE);
+    size_t rest = file_size - BMP_HEADER_SIZE;
+    assert_file_format(fread(data + BMP_HEADER_SIZE, 1, rest, stream) == rest);
+
+    *bmp = parse_bmp(data, file_size);
+    BmpHeader *header = bmp->header;
+    header->buffer = data;
+    return true;
+}
+
 
 void assert_write(bool condition) {
     if (!condition) {
@@ -148,37 +209,36 @@ void assert_write(bool condition) {
 
 void write_bmp(Bmp bmp, char *filename) {
 
-    FILE *fp = fopen(filename, "w");
-    check_fp(fp, filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    check_fd(fd, filename);
 
     BmpHeader *header = (BmpHeader *)bmp.header;
 
-    // Write entire header (everything but pixel array)
-    size_t bytes_written = fwrite(header->raw, 1, header->pixel_array_offset, fp);
-    assert_write(bytes_written == header->pixel_array_offset);
-
-    // Write rest of file
-    // Loop backward through rows (image indexed from bottom left
-    for (unsigned int y = 0; y < header->height; y++) {
-        for (unsigned int x = 0; x < header->width; x++) {
-
-            unsigned char *pixel = bmp.pixels[y][x];
-            fwrite(&pixel[BLUE], 1, 1, fp);
-            fwrite(&pixel[GREEN], 1, 1, fp);
-            fwrite(&pixel[RED], 1, 1, fp);
+    // Entire header (everything but pixel array) followed by every padded row,
+    // which are already laid out exactly as in the file (image indexed from bottom left)
+    struct iovec parts[2] = {
+        { .iov_base = header->raw, .iov_len = header->pixel_array_offset },
+        { .iov_base = bmp.pixels, .iov_len = (size_t)header->row_size * header->height },
+    };
+    struct iovec *next = parts;
+    int remaining = 2;
+
+    // Emit both parts with one writev, continuing only if it was cut short
+    while (remaining > 0) {
+        ssize_t bytes_written = writev(fd, next, remaining);
+        assert_write(bytes_written >= 0);
+        while (remaining > 0 && (size_t)bytes_written >= next->iov_len) {
+            bytes_written -= next->iov_len;
+            next++;
+            remaining--;
         }
-
-        // Write padding
-        if ((header->width * 3) % 4 != 0) {
-            char null_byte = 0x00;
-            for (unsigned int i = 0; i < 4 - (header->width * 3) % 4; i++) {
-                fwrite(&null_byte, 1, 1, fp);
-            }
+        if (remaining > 0) {
+            next->iov_base = (uint8_t *)next->iov_base + bytes_written;
+            next->iov_len -= bytes_written;
         }
     }
 
-
-    fclose(fp);
+    close(fd);
 }
 
 
@@ -199,6 +259,8 @@ Bmp copy_bmp(Bmp old_bmp) {
     Bmp new_bmp = old_bmp;
     new_bmp.header = NULL;
     new_bmp.pixels = NULL;
+    new_bmp.region = NULL;
+    new_bmp.object_type = NULL;
 
     // Copy header
     BmpHeader *header = malloc(sizeof(BmpHeader));
@@ -206,6 +268,9 @@ Bmp copy_bmp(Bmp old_bmp) {
     memcpy(header, old_header, sizeof(BmpHeader));
     new_bmp.header = header;
     header->raw = NULL;
+    header->mapping = NULL;
+    header->mapping_size = 0;
+    header->buffer = NULL;
 
     // Copy raw header
     header->raw = malloc(sizeof(unsigned char) * old_header->pixel_array_offset);
@@ -213,52 +278,107 @@ Bmp copy_bmp(Bmp old_bmp) {
     memcpy(header->raw, old_header->raw, old_header->pixel_array_offset);
 
     // Copy rest of image
-    new_bmp.pixels = calloc(header->height, sizeof(unsigned char **));
+    size_t image_size = (size_t)new_bmp.stride * new_bmp.height;
+    new_bmp.pixels = alloc_pixels(image_size);
     assert_copy(new_bmp.pixels != NULL);
-    for (unsigned int i = 0; i < header->height; i++) {
-        new_bmp.pixels[i] = calloc(header->width, sizeof(unsigned char *));
-        assert_copy(new_bmp.pixels[i] != NULL);
-
-        for (unsigned int j = 0; j < header->width; j++) {
-            new_bmp.pixels[i][j] = malloc(6 * sizeof(unsigned char));                       // Changed by Dylan
-            assert_copy(new_bmp.pixels[i][j] != NULL);
-            memcpy(new_bmp.pixels[i][j], old_bmp.pixels[i][j], 6 * sizeof(unsigned char));  // Changed by Dylan
-        }
-    }
+    memcpy(new_bmp.pixels, old_bmp.pixels, image_size);
+    return new_bmp;
+}
+
+// Create a black 24-bit image
+Bmp create_bmp(unsigned int width, unsigned int height) {
+
+    Bmp bmp;
+    bmp.width = width;
+    bmp.height = height;
+    bmp.region = NULL;
+    bmp.object_type = NULL;
+
+    BmpHeader *header = calloc(1, sizeof(BmpHeader));
+    assert_copy(header != NULL);
+    bmp.header = header;
+    header->width = width;
+    header->height = height;
+    header->pixel_size = 24;
+    header->row_size = ((header->pixel_size * width + 31) / 32) * 4;
+    header->pixel_array_offset = BMP_HEADER_SIZE;
+    header->data_size = header->row_size * height;
+    header->file_size = header->pixel_array_offset + header->data_size;
+
+    // Standard header followed by a BITMAPINFOHEADER (everything else stays 0)
+    uint16_t planes = 1;
+    uint32_t info_header_size = INFO_HEADER_SIZE;
+    header->raw = calloc(BMP_HEADER_SIZE, 1);
+    assert_copy(header->raw != NULL);
+    header->raw[0] = 'B';
+    header->raw[1] = 'M';
+    memcpy(header->raw + SIZE_OFFSET, &header->file_size, sizeof(uint32_t));
+    memcpy(header->raw + PIXEL_ARRAY_OFFSET, &header->pixel_array_offset, sizeof(uint32_t));
+    memcpy(header->raw + INFO_HEADER_SIZE_OFFSET, &info_header_size, sizeof(uint32_t));
+    memcpy(header->raw + WIDTH_OFFSET, &header->width, sizeof(uint32_t));
+    memcpy(header->raw + HEIGHT_OFFSET, &header->height, sizeof(uint32_t));
+    memcpy(header->raw + PLANES_OFFSET, &planes, sizeof(uint16_t));
+    memcpy(header->raw + PIXEL_SIZE_OFFSET, &header->pixel_size, sizeof(uint16_t));
+    memcpy(header->raw + DATA_SIZE_OFFSET, &header->data_size, sizeof(uint32_t));
+
+    bmp.stride = header->row_size;
+    bmp.pixels = alloc_pixels(header->data_size);
+    assert_copy(bmp.pixels != NULL);
+    memset(bmp.pixels, 0, header->data_size);
+    return bmp;
+}
+
+// Give an image zeroed side planes if it does not have them yet
+Bmp add_planes(Bmp bmp) {
 
     // ADDED BY DYLAN
-    // Initialise pixel regions and visited number to zero
-    for (unsigned int y = 0; y < header->height; y++) {
-        for (unsigned int x = 0; x < header->width; x++) {
-            new_bmp.pixels[y][x][PIXEL_REGION_INDEX] = -1;  // Initialise region value to -1 (unsigned region)
-            new_bmp.pixels[y][x][VISITED_INDEX] = 0;        // Initialise visited value to 0 (not visited)
-            new_bmp.pixels[y][x][OBJECT_TYPE_INDEX] = old_bmp.pixels[y][x][OBJECT_TYPE_INDEX];
+    // Side planes start zeroed (no region, object type 0)
+    if (bmp.region == NULL) {
+        size_t plane_size = (size_t)bmp.width * bmp.height;
+        bmp.region = calloc(plane_size, sizeof(unsigned int));
+        bmp.object_type = calloc(plane_size, sizeof(unsigned short));
+        assert_copy(bmp.region != NULL && bmp.object_type != NULL);
+    }
+    return bmp;
+}
+
+// Reuse a copy of an image for another image of the same size
+Bmp reuse_bmp(Bmp source, Bmp target) {
+
+    BmpHeader *source_header = (BmpHeader *)source.header;
+    BmpHeader *target_header = (BmpHeader *)target.header;
+
+    // Different size (or no copy yet): start again from a fresh copy
+    if (target_header == NULL || target.width != source.width || target.height != source.height ||
+        target_header->pixel_array_offset != source_header->pixel_array_offset) {
+        if (target_header != NULL) {
+            free_bmp(target);
         }
+        return copy_bmp(source);
     }
-    return new_bmp;
+
+    memcpy(target_header->raw, source_header->raw, source_header->pixel_array_offset);
+    return target;
 }
 
 void free_bmp(Bmp bmp) {
 
     BmpHeader *header = (BmpHeader *)bmp.header;
 
-    // Free each row
-    for (unsigned int i = 0; i < header->height; i++) {
-
-        // Free each pixel
-        for (unsigned int j = 0; j < header->width; j++) {
-            free(bmp.pixels[i][j]); 
-            bmp.pixels[i][j] = NULL;
-        }
-        free(bmp.pixels[i]);
-        bmp.pixels[i] = NULL;
-    }
-    free(bmp.pixels); 
-    bmp.pixels = NULL;
+    // Free side planes
+    free(bmp.region);
+    free(bmp.object_type);
 
-    // Free raw header
+    // Free raw header and pixel buffer, or unmap the file they both live in
     if (header != NULL) {
-        free(header->raw);
+        if (header->mapping != NULL) {
+            munmap(header->mapping, header->mapping_size);
+        } else if (header->buffer != NULL) {
+            free(header->buffer);
+        } else {
+            free(header->raw);
+            free(bmp.pixels);
+        }
         header->raw = NULL;
         free(header);
     }
@@ -344,22 +464,20 @@ int hue_midpoint(int hue1, int hue2) {
     }
 }
 
+// Paint the 3 colour bytes of a pixel white
+static void paint_white(unsigned char *pixel) {
+    pixel[RED] = 255;
+    pixel[GREEN] = 255;
+    pixel[BLUE] = 255;
+}
+
 void draw_box(Bmp image, int x, int y, int width, int height) {
     for (int r = y; r < (y+height); r++) {
-        image.pixels[r][x][RED] = 255;
-        image.pixels[r][x][GREEN] = 255;
-        image.pixels[r][x][BLUE] = 255;
-        image.pixels[r][x+width-1][RED] = 255;
-        image.pixels[r][x+width-1][GREEN] = 255;
-        image.pixels[r][x+width-1][BLUE] = 255;
+        paint_white(bmp_pixel(image, x, r));
+        paint_white(bmp_pixel(image, x+width-1, r));
     }
     for (int c = x; c < (x+width); c++) {
-        image.pixels[y][c][RED] = 255;
-        image.pixels[y][c][GREEN] = 255;
-        image.pixels[y][c][BLUE] = 255;
-        image.pixels[y+height-1][c][RED] = 255;
-        image.pixels[y+height-1][c][GREEN] = 255;
-        image.pixels[y+height-1][c][BLUE] = 255;
+        paint_white(bmp_pixel(image, c, y));
+        paint_white(bmp_pixel(image, c, y+height-1));
     }
 }
-
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "cam_detect.h"
+#include "calibration_store.h"
+
+#define CALIBRATION_DELIMITERS " \t\r\n"   // Separators between the fields of a text line
+#define HALF_CIRCLE 180                     // Largest hue difference there is
+
+// Start of a compiled store file, followed by the objects, the bucket offsets and the bucket objects
+typedef struct {
+    char magic[STORE_MAGIC_LENGTH];
+    uint32_t num_objects;
+    uint32_t num_entries;   // Objects listed across all the buckets
+} StoreHeader;
+
+// Bytes a store with this many objects and bucket entries takes
+static size_t store_size(uint32_t num_objects, uint32_t num_entries) {
+    return sizeof(StoreHeader) + (size_t)num_objects * sizeof(CalibratedObject) + (HUE_RANGE + 1) * sizeof(uint32_t)
+        + (size_t)num_entries * sizeof(uint16_t);
+}
+
+// Point a store at the objects and index inside a buffer laid out like a store file
+static void attach_store(CalibrationStore* store, void* base) {
+    const StoreHeader* header = base;
+    store->num_objects = (int)header->num_objects;
+    store->objects = (const CalibratedObject*)((unsigned char*)base + sizeof(StoreHeader));
+    store->bucket_start = (const uint32_t*)(store->objects + header->num_objects);
+    store->bucket_objects = (const uint16_t*)(store->bucket_start + HUE_RANGE + 1);
+}
+
+int object_covers_hue(const CalibratedObject* object, int hue) {
+    for (int range = 0; range < object->num_ranges; range++) {
+        if (hue_difference(object->ranges[range].hue_mid, hue) <= object->ranges[range].max_hue_diff) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int add_hue_range(CalibratedObject* object, int hue_mid, int max_hue_diff) {
+    if (object->num_ranges >= MAX_HUE_RANGES) {
+        return 0;
+    }
+    object->ranges[object->num_ranges].hue_mid = hue_mid;
+    object->ranges[object->num_ranges].max_hue_diff = max_hue_diff;
+    object->num_ranges++;
+    return 1;
+}
+
+// Read a whole number field between min and max
+static int parse_field(char* token, int min, int max, int32_t* field) {
+    if (token == NULL) {
+        return 0;
+    }
+    char* end;
+    long number = strtol(token, &end, 10);
+    if (*token == '\0' || *end != '\0' || number < min || number > max) {
+        return 0;
+    }
+    *field = (int32_t)number;
+    return 1;
+}
+
+int parse_calibration_line(char* line, CalibratedObject* object) {
+    memset(object, 0, sizeof(*object));
+    char* save_pointer;
+    char* name = strtok_r(line, CALIBRATION_DELIMITERS, &save_pointer);
+    if (name == NULL || strlen(name) >= OBJECT_NAME_LENGTH) {
+        return 0;
+    }
+    strcpy(object->name, name);
+
+    // The first hue range comes before the saturation and value minimums
+    HueRange range;
+    if (!parse_field(strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer), 0, HUE_RANGE - 1, &range.hue_mid)
+        || !parse_field(strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer), 0, HALF_CIRCLE, &range.max_hue_diff)
+        || !parse_field(strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer), 0, MAX_PERCENT, &object->saturation_min)
+        || !parse_field(strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer), 0, MAX_PERCENT, &object->value_min)) {
+        return 0;
+    }
+    add_hue_range(object, range.hue_mid, range.max_hue_diff);
+
+    // Any further pairs are extra hue ranges
+    char* token;
+    while ((token = strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer)) != NULL) {
+        if (!parse_field(token, 0, HUE_RANGE - 1, &range.hue_mid)
+            || !parse_field(strtok_r(NULL, CALIBRATION_DELIMITERS, &save_pointer), 0, HALF_CIRCLE, &range.max_hue_diff)
+            || !add_hue_range(object, range.hue_mid, range.max_hue_diff)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+CalibratedObject* reserve_object(CalibratedObject* objects, int num_objects, int* capacity) {
+    if (num_objects < *capacity) {
+        return objects;
+    }
+    *capacity = (*capacity > 0) ? *capacity * 2 : INITIAL_OBJECTS;
+    objects = realloc(objects, *capacity * sizeof(CalibratedObject));
+    if (objects == NULL) {
+        fprintf(stderr, "Could not allocate calibration store\n");
+        exit(1);
+    }
+    return objects;
+}
+
+// rgb2hsv's value only depends on the brightest channel, so each value
+// minimum becomes the first brightest channel that passes it
+static int min_max_channel(int value_min) {
+    unsigned char grey[BYTES_PER_PIXEL];
+    for (int channel = 0; channel <= 255; channel++) {
+        grey[RED] = grey[GREEN] = grey[BLUE] = channel;
+        if (rgb2hsv(grey).value >= value_min) {
+            return channel;
+        }
+    }
+    return 256;
+}
+
+CalibrationStore compile_calibration_store(const CalibratedObject* objects, int num_objects) {
+    // Count the objects covering each hue first so the index is sized exactly
+    uint32_t num_entries = 0;
+    for (int hue = 0; hue < HUE_RANGE; hue++) {
+        for (int object = 0; object < num_objects; object++) {
+            num_entries += object_covers_hue(&objects[object], hue);
+        }
+    }
+
+    CalibrationStore store;
+    memset(&store, 0, sizeof(store));
+    store.size = store_size(num_objects, num_entries);
+    store.buffer = calloc(1, store.size);
+    if (store.buffer == NULL) {
+        fprintf(stderr, "Could not allocate calibration store\n");
+        exit(1);
+    }
+
+    StoreHeader* header = store.buffer;
+    memcpy(header->magic, STORE_MAGIC, STORE_MAGIC_LENGTH);
+    header->num_objects = num_objects;
+    header->num_entries = num_entries;
+    attach_store(&store, store.buffer);
+
+    CalibratedObject* store_objects = (CalibratedObject*)store.objects;
+    uint32_t* bucket_start = (uint32_t*)store.bucket_start;
+    uint16_t* bucket_objects = (uint16_t*)store.bucket_objects;
+    if (num_objects > 0) {
+        memcpy(store_objects, objects, num_objects * sizeof(CalibratedObject));
+    }
+    for (int object = 0; object < num_objects; object++) {
+        store_objects[object].min_max_channel = min_max_channel(store_objects[object].value_min);
+    }
+
+    uint32_t entry = 0;
+    for (int hue = 0; hue < HUE_RANGE; hue++) {
+        bucket_start[hue] = entry;
+        for (int object = 0; object < num_objects; object++) {
+            if (object_covers_hue(&objects[object], hue)) {
+                bucket_objects[entry++] = object;
+            }
+        }
+    }
+    bucket_start[HUE_RANGE] = entry;
+    return store;
+}
+
+// Check one object holds what parse_calibration_line accepts, with a matching min_max_channel
+static int valid_object(const CalibratedObject* object) {
+    if (memchr(object->name, '\0', OBJECT_NAME_LENGTH) == NULL || object->num_ranges < 1 || object->num_ranges > MAX_HUE_RANGES
+        || object->saturation_min < 0 || object->saturation_min > MAX_PERCENT
+        || object->value_min < 0 || object->value_min > MAX_PERCENT
+        || object->min_max_channel != min_max_channel(object->value_min)) {
+        return 0;
+    }
+    for (int range = 0; range < object->num_ranges; range++) {
+        if (object->ranges[range].hue_mid < 0 || object->ranges[range].hue_mid >= HUE_RANGE
+            || object->ranges[range].max_hue_diff < 0 || object->ranges[range].max_hue_diff > HALF_CIRCLE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check every count, offset and field of a mapped store so lookups stay inside
+// it, and that the index lists exactly the objects covering each hue
+static int valid_store(const void* base, size_t size) {
+    if (size < sizeof(StoreHeader)) {
+        return 0;
+    }
+    const StoreHeader* header = base;
+    if (memcmp(header->magic, STORE_MAGIC, STORE_MAGIC_LENGTH) != 0 || header->num_objects > MAX_OBJECTS
+        || header->num_entries > (uint32_t)HUE_RANGE * header->num_objects
+        || size != store_size(header->num_objects, header->num_entries)) {
+        return 0;
+    }
+
+    CalibrationStore store;
+    attach_store(&store, (void*)base);
+    for (int object = 0; object < store.num_objects; object++) {
+        if (!valid_object(&store.objects[object])) {
+            return 0;
+        }
+    }
+    uint32_t entry = 0;
+    for (int hue = 0; hue < HUE_RANGE; hue++) {
+        if (store.bucket_start[hue] != entry) {
+            return 0;
+        }
+        for (int object = 0; object < store.num_objects; object++) {
+            if (object_covers_hue(&store.objects[object], hue)) {
+                if (entry >= header->num_entries || store.bucket_objects[entry] != object) {
+                    return 0;
+                }
+                entry++;
+            }
+        }
+    }
+    return store.bucket_start[HUE_RANGE] == entry && entry == header->num_entries;
+}
+
+// Map a compiled store file
+static CalibrationStore map_calibration_store(char* store_path) {
+    int fd = open(store_path, O_RDONLY);
+    if (fd < 0) {
+        error_exit(FILE_NOT_FOUND);
+    }
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0) {
+        error_exit(FILE_NOT_FOUND);
+    }
+    CalibrationStore store;
+    memset(&store, 0, sizeof(store));
+    store.size = file_info.st_size;
+    store.mapping = mmap(NULL, store.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (store.mapping == MAP_FAILED) {
+        fprintf(stderr, "Invalid calibration store %s\n", store_path);
+        exit(1);
+    }
+    if (store.size >= STORE_MAGIC_LENGTH && memcmp(store.mapping, STORE_MAGIC, STORE_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "Calibration store %s was compiled by another version (%.*s, expected %s), compile it again from its text file\n",
+                store_path, STORE_MAGIC_LENGTH, (const char*)store.mapping, STORE_MAGIC);
+        exit(1);
+    }
+    if (!valid_store(store.mapping, store.size)) {
+        fprintf(stderr, "Invalid calibration store %s\n", store_path);
+        exit(1);
+    }
+    attach_store(&store, store.mapping);
+    return store;
+}
+
+// Read a text calibration file, one object per line (blank lines are skipped)
+static CalibrationStore read_calibration_text(char* calibration_file_path) {
+    FILE* file_pointer = fopen(calibration_file_path, "r");
+    if (file_pointer == NULL) {
+        error_exit(FILE_NOT_FOUND);
+    }
+
+    CalibratedObject* objects = NULL;
+    int num_objects = 0;
+    int capacity = 0;
+    char line[STR_BUFFER_SIZE];
+    for (int line_number = 1; fgets(line, sizeof(line), file_pointer) != NULL; line_number++) {
+        if (line[strspn(line, CALIBRATION_DELIMITERS)] == '\0') {
+            continue;
+        }
+        if (num_objects == MAX_OBJECTS) {
+            fprintf(stderr, "Too many objects in %s (at most %d, as object types are stored in 16 bits)\n", calibration_file_path, MAX_OBJECTS);
+            exit(1);
+        }
+        objects = reserve_object(objects, num_objects, &capacity);
+        if (!parse_calibration_line(line, &objects[num_objects])) {
+            fprintf(stderr, "Invalid calibration on line %d of %s\n", line_number, calibration_file_path);
+            exit(1);
+        }
+        num_objects++;
+    }
+    fclose(file_pointer);
+
+    CalibrationStore store = compile_calibration_store(objects, num_objects);
+    free(objects);
+    return store;
+}
+
+int is_compiled_store(char* calibration_file_path) {
+    FILE* file_pointer = fopen(calibration_file_path, "rb");
+    if (file_pointer == NULL) {
+        return 0;
+    }
+    char magic[STORE_MAGIC_LENGTH];
+    int compiled = fread(magic, 1, STORE_MAGIC_LENGTH, file_pointer) == STORE_MAGIC_LENGTH
+        && memcmp(magic, STORE_MAGIC, STORE_MAGIC_PREFIX_LENGTH) == 0;
+    fclose(file_pointer);
+    return compiled;
+}
+
+CalibrationStore load_calibration_store(char* calibration_file_path) {
+    if (is_compiled_store(calibration_file_path)) {
+        return map_calibration_store(calibration_file_path);
+    }
+    return read_calibration_text(calibration_file_path);
+}
+
+void print_calibration_line(FILE* file_pointer, const CalibratedObject* object) {
+    fprintf(file_pointer, "%s %d %d %d %d", object->name, object->ranges[0].hue_mid, object->ranges[0].max_hue_diff,
+            object->saturation_min, object->value_min);
+    for (int range = 1; range < object->num_ranges; range++) {
+        fprintf(file_pointer, " %d %d", object->ranges[range].hue_mid, object->ranges[range].max_hue_diff);
+    }
+}
+
+// Write a file under a temporary name and rename it into place, so readers
+// never see a half written one
+static int replace_file(char* path, const CalibrationStore* store, int compiled) {
+    char temp_path[STR_BUFFER_SIZE + 2 * INT_BUFFER_SIZE];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld", path, (long)getpid());
+
+    FILE* file_pointer = fopen(temp_path, compiled ? "wb" : "w");
+    if (file_pointer == NULL) {
+        return 0;
+    }
+    int ok = 1;
+    if (compiled) {
+        const void* base = (store->mapping != NULL) ? store->mapping : store->buffer;
+        ok = fwrite(base, 1, store->size, file_pointer) == store->size;
+    } else {
+        for (int object = 0; object < store->num_objects; object++) {
+            print_calibration_line(file_pointer, &store->objects[object]);
+            fputc('\n', file_pointer);
+        }
+    }
+    ok = (fclose(file_pointer) == 0) && ok;
+
+    if (!ok || rename(temp_path, path) != 0) {
+        remove(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+int save_calibration_store(const CalibrationStore* store, char* store_path) {
+    return replace_file(store_path, store, 1);
+}
+
+int save_calibration_text(const CalibrationStore* store, char* text_path) {
+    return replace_file(text_path, store, 0);
+}
+
+void free_calibration_store(CalibrationStore store) {
+    if (store.mapping != NULL) {
+        munmap(store.mapping, store.size);
+    } else {
+        free(store.buffer);
+    }
+}
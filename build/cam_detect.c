@@ -1,5 +1,12 @@
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
 #include "bitmap.h"
 #include "cam_detect.h"
+#include "frame_queue.h"
+#include "temporal.h"
 
 // Display type of error and exit
 void error_exit(int error_type) {
@@ -19,250 +26,526 @@ void clean_line(char* line) {
     }
 }
 
-// Display text file information
-void load_calibration_data(char* calibration_file_path, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int* num_calibrations) {
-    char line[STR_BUFFER_SIZE];
-    FILE* file_pointer = fopen(calibration_file_path, "r");
+// Print out the objects of a calibration file or compiled store
+void display_calibration_file(char* calibration_file_path) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
 
-    if (file_pointer == NULL) {
-        error_exit(FILE_NOT_FOUND);
+    printf("Calibrated Objects:\n");
+    for (int object_num = 0; object_num < store.num_objects; object_num++) {
+        const CalibratedObject* object = &store.objects[object_num];
+        printf("%s:", object->name);
+        for (int range = 0; range < object->num_ranges; range++) {
+            printf(" Hue: %d (Max. Diff: %d),", object->ranges[range].hue_mid, object->ranges[range].max_hue_diff);
+        }
+        printf(" Min. SV: %d %d\n", object->saturation_min, object->value_min);
     }
 
-    while (fgets(line, sizeof(line), file_pointer) != NULL) {
-        clean_line(line);
-        char* token = strtok(line, " ");
-        int i = 0;
-        while (token != NULL && i < LEN_CALIBRATION_DATA) {
-            data[*num_calibrations][i] = (char*)malloc(strlen(token) + 1);
-            strcpy(data[*num_calibrations][i], token);
-            i++;
-            token = strtok(NULL, " ");
+    free_calibration_store(store);
+}
+
+// Creates threshold mask for image and labels its regions, one band of rows per thread
+Bmp create_threshold_image(Bmp image_bmp, const ThresholdEngine* engine, ThreadPool* pool, RegionTable* regions) {
+    Bmp threshold_image = add_planes(copy_bmp(image_bmp));
+    threshold_and_label(pool, engine, image_bmp, threshold_image, regions);
+    return threshold_image;
+}
+
+// Change pixels to a certain colour
+void set_pixel_black(Bmp image, int x, int y) {
+    unsigned char* pixel = bmp_pixel(image, x, y);
+    pixel[RED] = black.red_value;
+    pixel[GREEN] = black.green_value;
+    pixel[BLUE] = black.blue_value;
+}
+
+void set_pixel_white(Bmp image, int x, int y) {
+    unsigned char* pixel = bmp_pixel(image, x, y);
+    pixel[RED] = white.red_value;
+    pixel[GREEN] = white.green_value;
+    pixel[BLUE] = white.blue_value;
+}
+
+
+// Whether a region is big enough to be reported
+int is_detection(const Region* region) {
+    int box_width = region->max_x - region->min_x + 1;
+    int box_height = region->max_y - region->min_y + 1;
+    return box_width >= MIN_BOX_SIZE && box_height >= MIN_BOX_SIZE;
+}
+
+DetectionList create_detection_list(void) {
+    DetectionList detections;
+    memset(&detections, 0, sizeof(detections));
+    return detections;
+}
+
+void free_detection_list(DetectionList* detections) {
+    free(detections->regions);
+    memset(detections, 0, sizeof(*detections));
+}
+
+// Append a region to a detection list, growing it if full
+static void add_detection(DetectionList* detections, const Region* region) {
+    if (detections->count == detections->capacity) {
+        detections->capacity = (detections->capacity > 0) ? detections->capacity * 2 : INITIAL_DETECTIONS;
+        detections->regions = realloc(detections->regions, detections->capacity * sizeof(const Region*));
+        if (detections->regions == NULL) {
+            fprintf(stderr, "Could not allocate detection list\n");
+            exit(1);
         }
-        (*num_calibrations)++;
     }
-    fclose(file_pointer);
+    detections->regions[detections->count++] = region;
 }
 
-// Print out data from given calibration file
-void display_calibration_file(char* calibration_file_path) {
-    FILE* file_pointer = fopen(calibration_file_path, "r");
-    if (file_pointer == NULL) {
-        error_exit(FILE_NOT_FOUND);
+// Sort helper grouping detections by object type, keeping each group in the
+// scan order of the region table they point into
+static int compare_detections(const void* first, const void* second) {
+    const Region* a = *(const Region* const*)first;
+    const Region* b = *(const Region* const*)second;
+    if (a->object_type != b->object_type) {
+        return (a->object_type < b->object_type) ? -1 : 1;
     }
+    return (a > b) - (a < b);
+}
 
-    char line[STR_BUFFER_SIZE];
-    printf("Calibrated Objects:\n");
-    while (fgets(line, sizeof(line), file_pointer) != NULL) {
-        clean_line(line);
-        
-        // Tokenize the line into the calibration data
-        char* tokens[LEN_CALIBRATION_DATA];
-        char* token = strtok(line, " ");
-        int i = 0;
-        while (token != NULL && i < LEN_CALIBRATION_DATA) {
-            tokens[i++] = token;
-            token = strtok(NULL, " ");
+// List the regions to report, grouped by object type, and box them. The
+// regions are walked once and only the reported ones are sorted, so the cost
+// does not grow with the number of calibrated objects
+int collect_detections(const CalibrationStore* store, const RegionTable* regions, Bmp* image_with_boxes, DetectionList* detections) {
+    detections->count = 0;
+    for (int i = 0; i < regions->count; i++) {
+        const Region* region = &regions->regions[i];
+        if (region->object_type < store->num_objects && is_detection(region)) {
+            add_detection(detections, region);
         }
+    }
+    qsort(detections->regions, detections->count, sizeof(const Region*), compare_detections);
 
-        // Check that we have enough tokens
-        if (i >= 5) {
-            // Extract fields for formatted output
-            char* name = tokens[0];
-            char* hue = tokens[1];
-            char* max_diff = tokens[2];
-            char* min_saturation = tokens[3];
-            char* min_value = tokens[4];
-
-            // Print formatted output
-            printf("%s: Hue: %s (Max. Diff: %s), Min. SV: %s %s\n", name, hue, max_diff, min_saturation, min_value);
-        } else {
-            printf("Too many arguments in calibration file\n");
+    if (image_with_boxes != NULL) {
+        for (int i = 0; i < detections->count; i++) {
+            const Region* region = detections->regions[i];
+            draw_box(*image_with_boxes, region->min_x, region->min_y,
+                     region->max_x - region->min_x + 1, region->max_y - region->min_y + 1);
         }
     }
+    return detections->count;
+}
 
-    fclose(file_pointer);
+// Print data for detection boxes
+void print_detections(const CalibrationStore* store, const DetectionList* detections) {
+    for (int i = 0; i < detections->count; i++) {
+        const Region* region = detections->regions[i];
+        int box_width = region->max_x - region->min_x + 1;
+        int box_height = region->max_y - region->min_y + 1;
+        printf("Detected %s: %d %d %d %d\n", store->objects[region->object_type].name,
+               region->min_x, region->min_y, box_width, box_height);
+    }
 }
 
-// Creates threshold mask for image with given calibration data
-Bmp apply_threshold_to_image(Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations) {
-    int height = image_bmp.height;
-    int width = image_bmp.width;
-    unsigned char*** pixels = image_bmp.pixels;
-    Bmp threshold_image = copy_bmp(image_bmp);
-
-    for (int calibration = 0; calibration < num_calibrations; calibration++) {
-        int hue_mid = atoi(data[calibration][HUE_MID_INDEX]);
-        int max_hue_diff = atoi(data[calibration][MAX_HUE_INDEX]);
-
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                HSV hsv_values = rgb2hsv(pixels[y][x]);
-                int hue = hsv_values.hue;
-                int saturation = hsv_values.saturation;
-                int value = hsv_values.value;
-                int hue_diff = hue_difference(hue_mid, hue);
-                int visited = pixels[y][x][VISITED_INDEX];
-
-                if ((saturation >= SATURATION_THRESHOLD) && (value >= VALUE_THRESHOLD) && (hue_diff <= max_hue_diff) && (visited == NOT_VISITED)) {
-                    set_pixel_white(threshold_image, x, y);
-                    pixels[y][x][VISITED_INDEX] = VISITED;
-                    threshold_image.pixels[y][x][OBJECT_TYPE_INDEX] = calibration;
-                } else if (visited == NOT_VISITED) {
-                    set_pixel_black(threshold_image, x, y);
-                }
-            }
+// Detects objects in image based on calibration file and outputs relevant masks
+void detection_mode(char* calibration_file_path, char* image_file_path, int num_threads, int show_timing) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
+
+    ThresholdEngine engine = create_threshold_engine(calibration_file_path, &store, KERNEL_AUTO);
+    ThreadPool* pool = create_thread_pool(num_threads);
+    RegionTable regions = create_region_table();
+    DetectionList detections = create_detection_list();
+    StageTimes stage_times = create_stage_times(1);
+    StageTimes* times = show_timing ? &stage_times : NULL;
+    start_frame_times(times);
+
+    // The pages are faulted in here so the read stage covers the whole file
+    double start = clock_seconds();
+    Bmp image_bmp = read_bmp_populated(image_file_path);
+    record_stage(times, STAGE_READ, clock_seconds() - start);
+
+    // Timing runs threshold and label as separate passes so each can be measured
+    Bmp threshold_image;
+    if (show_timing) {
+        start = clock_seconds();
+        threshold_image = add_planes(copy_bmp(image_bmp));
+        threshold_rows(pool, &engine, image_bmp, threshold_image);
+        record_stage(times, STAGE_THRESHOLD, clock_seconds() - start);
+
+        start = clock_seconds();
+        threshold_and_label(pool, NULL, image_bmp, threshold_image, &regions);
+        record_stage(times, STAGE_LABEL, clock_seconds() - start);
+    } else {
+        threshold_image = create_threshold_image(image_bmp, &engine, pool, &regions);
+    }
+
+    start = clock_seconds();
+    Bmp image_with_regions = copy_bmp(image_bmp);
+    collect_detections(&store, &regions, &image_with_regions, &detections);
+    print_detections(&store, &detections);
+    record_stage(times, STAGE_CLASSIFY, clock_seconds() - start);
+
+    start = clock_seconds();
+    write_bmp(threshold_image, "output_images/threshold_output.bmp");
+    write_bmp(image_with_regions, "output_images/image_with_regions.bmp");
+    record_stage(times, STAGE_WRITE, clock_seconds() - start);
+
+    // Timings go to stderr as JSON so the detections on stdout are unchanged
+    if (show_timing) {
+        double megapixels = (double)image_bmp.width * image_bmp.height / 1e6;
+        fprintf(stderr, "{\"image\": ");
+        print_json_string(stderr, image_file_path);
+        fprintf(stderr, ", \"width\": %u, \"height\": %u, \"kernel\": \"%s\", \"threads\": %d,\n \"stages\": ",
+                image_bmp.width, image_bmp.height, threshold_kernel_name(engine.kernel_type), thread_pool_size(pool));
+        print_stage_json(stderr, times, megapixels);
+        fprintf(stderr, ",\n \"centroids\": [");
+        for (int i = 0; i < detections.count; i++) {
+            double centroid_x, centroid_y;
+            region_centroid(detections.regions[i], &centroid_x, &centroid_y);
+            fprintf(stderr, "%s[%.1f, %.1f]", (i > 0) ? ", " : "", centroid_x, centroid_y);
         }
+        fprintf(stderr, "],\n \"peak_rss_kb\": %ld, \"allocations\": %lu}\n", peak_rss_kb(), allocation_count());
     }
-    return threshold_image;
+
+    free_bmp(image_with_regions);
+    free_bmp(threshold_image);
+    free_bmp(image_bmp);
+    free_stage_times(&stage_times);
+    free_detection_list(&detections);
+    free_region_table(&regions);
+    free_thread_pool(pool);
+    free_threshold_engine(engine);
+    free_calibration_store(store);
 }
 
-// Loads calibration data and creates threshold image
-Bmp create_threshold_image(char* calibration_file_path, Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int* num_calibrations) {
-    
-    load_calibration_data(calibration_file_path, data, num_calibrations);
+// Reads the options of detect mode
+void parse_detect_options(int argc, char** argv, int* num_threads, int* show_timing) {
+    for (int i = ARGC_DETECT; i < argc; i++) {
+        if (strcmp(argv[i], TIMING_OPTION) == 0) {
+            *show_timing = 1;
+        } else if (i + 1 < argc) {
+            *num_threads = parse_thread_count(argv[i], argv[i + 1]);
+            i++;
+        } else {
+            error_exit(INCORRECT_INPUT);
+        }
+    }
+}
 
-    Bmp threshold_image = apply_threshold_to_image(image_bmp, data, *num_calibrations);
+// Reads the options of bench mode
+void parse_bench_options(int argc, char** argv, int* num_threads, int* iterations) {
+    for (int i = ARGC_BENCH; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            error_exit(INCORRECT_INPUT);
+        }
+        if (strcmp(argv[i], ITERATIONS_OPTION) == 0) {
+            *iterations = (int)parse_number(argv[i + 1], 1, INT_MAX);
+        } else {
+            *num_threads = parse_thread_count(argv[i], argv[i + 1]);
+        }
+    }
+}
 
-    return threshold_image;
+// Reads a whole number argument between min and max, exiting on anything else
+long parse_number(char* value, long min, long max) {
+    char* end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < min || number > max) {
+        error_exit(INCORRECT_INPUT);
+    }
+    return number;
 }
 
-// Change pixels to a certain colour
-void set_pixel_black(Bmp image, int x, int y) {
-    image.pixels[y][x][RED] = black.red_value;
-    image.pixels[y][x][GREEN] = black.green_value;
-    image.pixels[y][x][BLUE] = black.blue_value;
+// Reads the thread count given with THREADS_OPTION
+int parse_thread_count(char* option, char* value) {
+    if (strcmp(option, THREADS_OPTION) != 0) {
+        error_exit(INCORRECT_INPUT);
+    }
+    return (int)parse_number(value, 1, MAX_THREADS);
 }
 
-void set_pixel_white(Bmp image, int x, int y) {
-    image.pixels[y][x][RED] = white.red_value;
-    image.pixels[y][x][GREEN] = white.green_value;
-    image.pixels[y][x][BLUE] = white.blue_value;
-}
-
-
-// Print data for detection boxes and save to image
-void print_image_with_boxes(Bmp image_with_regions, Bmp threshold_image, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations, Region region_array[], int region_number) {
-    for (int object_num = 0; object_num < num_calibrations; object_num++) {
-        for (int i = 1; i < region_number; i++) {
-            int x_coord = region_array[i].min_x;
-            int y_coord = region_array[i].min_y;
-            int box_width = region_array[i].max_x - region_array[i].min_x + 1;
-            int box_height = region_array[i].max_y - region_array[i].min_y + 1;
-
-            int num = 0, sum = 0;
-            int q2_x = x_coord + box_width / 4;
-            int q3_x = x_coord + 3 * box_width / 4;
-            int q2_y = y_coord + box_height / 4;
-            int q3_y = y_coord + 3 * box_height / 4;
-            for (int x = q2_x; x < q3_x; x++) {
-                for (int y = q2_y; y < q3_y; y++) {
-                    sum += threshold_image.pixels[y][x][OBJECT_TYPE_INDEX];
-                    if (threshold_image.pixels[y][x][OBJECT_TYPE_INDEX] > 0) {
-                        num++;
-                    }
-                }
-            }
-            int average = (num != 0) ? sum / num : 0;
+// Sort helper for list_bmp_files
+static int compare_paths(const void* first, const void* second) {
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
 
-            if (average == object_num) {
-                char* name = data[object_num][NAME_INDEX];
-                if (box_width >= 20 && box_height >= 20) {
-                    draw_box(image_with_regions, x_coord, y_coord, box_width, box_height);
-                    printf("Detected %s: %d %d %d %d\n", name, x_coord, y_coord, box_width, box_height);
-                }
-            }
+// Append an allocated path to a growable list of paths
+static void append_path(char*** paths, int* num_paths, int* capacity, char* path) {
+    if (*num_paths == *capacity) {
+        *capacity = (*capacity > 0) ? *capacity * 2 : INITIAL_PATHS;
+        *paths = realloc(*paths, *capacity * sizeof(char*));
+        if (*paths == NULL) {
+            fprintf(stderr, "Could not allocate path list\n");
+            exit(1);
         }
     }
-    write_bmp(image_with_regions, "output_images/image_with_regions.bmp");
+    (*paths)[(*num_paths)++] = path;
 }
 
-// Function to check neighbours of a given pixel
-void depth_first_search(Bmp* threshold_image, int x, int y, Region region_array[], int* region_number) {
-    threshold_image->pixels[y][x][PIXEL_REGION_INDEX] = *region_number;
-    threshold_image->pixels[y][x][VISITED_INDEX] = VISITED;
+// Collects every .bmp file in a directory
+int list_bmp_files(char* directory_path, char*** image_paths) {
+    DIR* directory = opendir(directory_path);
+    if (directory == NULL) {
+        error_exit(INCORRECT_INPUT);
+    }
+
+    *image_paths = NULL;
+    int num_images = 0;
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".bmp") == 0) {
+            char* path = malloc(strlen(directory_path) + len + 2);
+            sprintf(path, "%s/%s", directory_path, entry->d_name);
+            append_path(image_paths, &num_images, &capacity, path);
+        }
+    }
+    closedir(directory);
 
-    int max_width = threshold_image->width;
-    int max_height = threshold_image->height;
+    qsort(*image_paths, num_images, sizeof(char*), compare_paths);
+    return num_images;
+}
 
-    if (x < region_array[*region_number].min_x) {
-        region_array[*region_number].min_x = x;
+// Collects the image paths listed in a text file, one per line
+int read_path_list(char* list_path, char*** image_paths) {
+    FILE* file_pointer = fopen(list_path, "r");
+    if (file_pointer == NULL) {
+        error_exit(INCORRECT_INPUT);
     }
-    if (x > region_array[*region_number].max_x) {
-        region_array[*region_number].max_x = x;
+
+    *image_paths = NULL;
+    int num_images = 0;
+    int capacity = 0;
+    char line[STR_BUFFER_SIZE];
+    while (fgets(line, sizeof(line), file_pointer) != NULL) {
+        clean_line(line);
+        if (line[0] != '\0') {
+            append_path(image_paths, &num_images, &capacity, strdup(line));
+        }
     }
-    if (y < region_array[*region_number].min_y) {
-        region_array[*region_number].min_y = y;
+    fclose(file_pointer);
+    return num_images;
+}
+
+// Frees a list of paths from list_bmp_files or read_path_list
+void free_path_list(char** image_paths, int num_images) {
+    for (int i = 0; i < num_images; i++) {
+        free(image_paths[i]);
     }
-    if (y > region_array[*region_number].max_y) {
-        region_array[*region_number].max_y = y;
+    free(image_paths);
+}
+
+// Verifies every threshold kernel the CPU supports against rgb2hsv
+void self_check_mode(char* calibration_file_path, char* image_paths[], int num_images) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
+
+    char** found_paths = NULL;
+    int num_found = 0;
+    if (num_images == 0) {
+        num_found = list_bmp_files(DEFAULT_IMAGE_DIRECTORY, &found_paths);
+        image_paths = found_paths;
+        num_images = num_found;
     }
 
-    int dx[] = {-1, 1, 0, 0};
-    int dy[] = {0, 0, -1, 1};
+    int failures = threshold_self_check(calibration_file_path, &store, image_paths, num_images);
+    printf("%s\n", (failures == 0) ? "Self check passed" : "Self check FAILED");
 
-    for (int i = 0; i < 4; i++) {
-        int adjacent_x = x + dx[i];
-        int adjacent_y = y + dy[i];
+    free_path_list(found_paths, num_found);
+    free_calibration_store(store);
+    if (failures != 0) {
+        exit(1);
+    }
+}
 
-        if (adjacent_x > 0 && adjacent_x < max_width && adjacent_y > 0 && adjacent_y < max_height &&
-            threshold_image->pixels[adjacent_y][adjacent_x][RED] == white.red_value &&
-            threshold_image->pixels[adjacent_y][adjacent_x][VISITED_INDEX] == 0) {
-            depth_first_search(threshold_image, adjacent_x, adjacent_y, region_array, region_number);
+// Where the frames of a batch come from, read on their own thread
+typedef struct {
+    FrameQueue* queue;
+    char** paths;       // Image files to read in order (when stream is NULL)
+    int num_paths;
+    FILE* stream;       // Concatenated images to read until it ends
+} FrameReader;
+
+// Reads every frame into the queue, faulting in each file here so reading overlaps with detection
+static void* read_frames(void* argument) {
+    FrameReader* reader = argument;
+    Frame frame;
+    if (reader->stream != NULL) {
+        frame.name = STDIN_SOURCE;
+        for (frame.index = 0; read_bmp_stream(reader->stream, &frame.image); frame.index++) {
+            push_frame(reader->queue, frame);
+        }
+    } else {
+        for (frame.index = 0; frame.index < reader->num_paths; frame.index++) {
+            frame.name = reader->paths[frame.index];
+            frame.image = read_bmp_populated(frame.name);
+            push_frame(reader->queue, frame);
         }
     }
+    close_frame_queue(reader->queue);
+    return NULL;
 }
 
-// Finds connected regions by iterating through grid and performing DFS
-void find_connected_regions(Bmp threshold_image, Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations) {
-    Bmp image_with_regions = copy_bmp(image_bmp);
-    int height = threshold_image.height;
-    int width = threshold_image.width;
-    unsigned char*** pixels = threshold_image.pixels;
-
-    Region region_array[MAX_REGIONS];
-    for (int i = 0; i < MAX_REGIONS; i++) {
-        region_array[i].min_x = width;
-        region_array[i].max_x = 0;
-        region_array[i].min_y = height;
-        region_array[i].max_y = 0;
-    }
-
-    int region_number = 1;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (pixels[y][x][RED] == white.red_value && pixels[y][x][VISITED_INDEX] == 0) {
-                depth_first_search(&threshold_image, x, y, region_array, &region_number);
-                region_number++;
-            }
-            threshold_image.pixels[y][x][VISITED_INDEX] = VISITED;
+// Picks where frames come from: stdin, a directory, a single image or a list of images
+static void open_frame_source(char* source, FrameReader* reader) {
+    struct stat source_info;
+    size_t source_len = strlen(source);
+    reader->queue = NULL;
+    reader->paths = NULL;
+    reader->num_paths = 0;
+    reader->stream = NULL;
+    if (strcmp(source, STDIN_SOURCE) == 0) {
+        reader->stream = stdin;
+    } else if (stat(source, &source_info) == 0 && S_ISDIR(source_info.st_mode)) {
+        reader->num_paths = list_bmp_files(source, &reader->paths);
+    } else if (source_len > 4 && strcmp(source + source_len - 4, ".bmp") == 0) {
+        reader->paths = malloc(sizeof(char*));
+        reader->paths[0] = strdup(source);
+        reader->num_paths = 1;
+    } else {
+        reader->num_paths = read_path_list(source, &reader->paths);
+    }
+}
+
+// Starts reading frames ahead into a bounded queue
+static pthread_t start_frame_reader(FrameReader* reader) {
+    reader->queue = create_frame_queue(FRAME_QUEUE_SIZE);
+    pthread_t reader_thread;
+    if (pthread_create(&reader_thread, NULL, read_frames, reader) != 0) {
+        fprintf(stderr, "Could not start reader thread\n");
+        exit(1);
+    }
+    return reader_thread;
+}
+
+// Waits for the reader (once every frame has been taken) and frees the source
+static void close_frame_source(FrameReader* reader, pthread_t reader_thread) {
+    pthread_join(reader_thread, NULL);
+    free_frame_queue(reader->queue);
+    free_path_list(reader->paths, reader->num_paths);
+}
+
+// Saves a frame with its boxes to the output directory
+static void save_frame(char* output_directory, Frame frame) {
+    char output_path[STR_BUFFER_SIZE];
+    snprintf(output_path, sizeof(output_path), "%s/" FRAME_FILE_FORMAT, output_directory, frame.index);
+    write_bmp(frame.image, output_path);
+}
+
+// Prints one line for a frame (index, name, number of detections, then the
+// name and box of each detection)
+static void print_frame_detections(Frame frame, const CalibrationStore* store, const DetectionList* detections) {
+    printf("%d %s %d", frame.index, frame.name, detections->count);
+    for (int i = 0; i < detections->count; i++) {
+        const Region* region = detections->regions[i];
+        printf(" %s %d %d %d %d", store->objects[region->object_type].name, region->min_x, region->min_y,
+               region->max_x - region->min_x + 1, region->max_y - region->min_y + 1);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Detects objects in a sequence of frames, keeping the calibration, threads and
+// buffers from one frame to the next
+void batch_mode(char* calibration_file_path, char* source, int num_threads, char* output_directory) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
+
+    FrameReader reader;
+    open_frame_source(source, &reader);
+
+    ThresholdEngine engine = create_threshold_engine(calibration_file_path, &store, KERNEL_AUTO);
+    ThreadPool* pool = create_thread_pool(num_threads);
+    RegionTable regions = create_region_table();
+    DetectionList detections = create_detection_list();
+    Bmp threshold_image;
+    memset(&threshold_image, 0, sizeof(threshold_image));
+
+    pthread_t reader_thread = start_frame_reader(&reader);
+
+    Frame frame;
+    while (pop_frame(reader.queue, &frame)) {
+        threshold_image = add_planes(reuse_bmp(frame.image, threshold_image));
+        threshold_and_label(pool, &engine, frame.image, threshold_image, &regions);
+
+        // The frame is not needed after this, so the boxes are drawn straight onto it
+        collect_detections(&store, &regions, (output_directory != NULL) ? &frame.image : NULL, &detections);
+        print_frame_detections(frame, &store, &detections);
+        if (output_directory != NULL) {
+            save_frame(output_directory, frame);
         }
+        free_bmp(frame.image);
     }
-    print_image_with_boxes(image_with_regions, threshold_image, data, num_calibrations, region_array, region_number);
-    free_bmp(image_with_regions);
+
+    close_frame_source(&reader, reader_thread);
+    if (threshold_image.header != NULL) {
+        free_bmp(threshold_image);
+    }
+    free_detection_list(&detections);
+    free_region_table(&regions);
+    free_thread_pool(pool);
+    free_threshold_engine(engine);
+    free_calibration_store(store);
 }
 
-// Detects objects in image based on calibration file and outputs relevant masks
-void detection_mode(char* calibration_file_path, char* image_file_path) {
-    char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA];
-    int num_calibrations = 0;
+// Detects objects in a sequence of frames, redoing only the tiles that changed
+// since the previous frame (and their neighbours)
+void temporal_mode(char* calibration_file_path, char* source, int num_threads, char* output_directory, int full_interval) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
 
-    Bmp image_bmp = read_bmp(image_file_path);
-    Bmp threshold_image = create_threshold_image(calibration_file_path, image_bmp, data, &num_calibrations);
+    FrameReader reader;
+    open_frame_source(source, &reader);
 
-    write_bmp(threshold_image, "output_images/threshold_output.bmp");
+    ThresholdEngine engine = create_threshold_engine(calibration_file_path, &store, KERNEL_AUTO);
+    ThreadPool* pool = create_thread_pool(num_threads);
+    TemporalState state = create_temporal_state(full_interval);
+    DetectionList detections = create_detection_list();
 
-    find_connected_regions(threshold_image, image_bmp, data, num_calibrations);
+    pthread_t reader_thread = start_frame_reader(&reader);
 
-    free_bmp(threshold_image);
-    free_bmp(image_bmp);
+    Frame frame;
+    while (pop_frame(reader.queue, &frame)) {
+        int whole_frame = detect_next_frame(&state, pool, &engine, frame.image);
+        printf("Frame %d %s: %s, %d tiles changed\n", frame.index, frame.name,
+               whole_frame ? "full" : "incremental", whole_frame ? state.tiles_x * state.tiles_y : state.num_dirty);
+
+        // The state keeps its own copy of the frame, so the boxes are drawn straight onto it
+        collect_detections(&store, &state.detections, (output_directory != NULL) ? &frame.image : NULL, &detections);
+        print_detections(&store, &detections);
+        fflush(stdout);
+
+        if (output_directory != NULL) {
+            save_frame(output_directory, frame);
+        }
+        free_bmp(frame.image);
+    }
+
+    close_frame_source(&reader, reader_thread);
+    free_detection_list(&detections);
+    free_temporal_state(&state);
+    free_thread_pool(pool);
+    free_threshold_engine(engine);
+    free_calibration_store(store);
 }
 
-// Takes in an image and produces calibration textfile with calibration data
-void calibration_mode(char* calibration_file_name, char* image_file_path) {
+// Reads the options of batch and temporal mode
+void parse_sequence_options(int argc, char** argv, int* num_threads, char** output_directory, int* full_interval) {
+    for (int i = ARGC_SEQUENCE; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            error_exit(INCORRECT_INPUT);
+        }
+        if (strcmp(argv[i], OUTPUT_OPTION) == 0) {
+            *output_directory = argv[i + 1];
+        } else if (strcmp(argv[i], FULL_INTERVAL_OPTION) == 0) {
+            if (full_interval == NULL) {
+                error_exit(INCORRECT_INPUT);
+            }
+            *full_interval = (int)parse_number(argv[i + 1], 0, INT_MAX);
+        } else {
+            *num_threads = parse_thread_count(argv[i], argv[i + 1]);
+        }
+    }
+}
+
+// Finds the hue window of the saturated, bright pixels in the middle of an image
+HueRange calibrate_image(char* image_file_path) {
     Bmp image_bmp = read_bmp(image_file_path);
     int height = image_bmp.height;
     int width = image_bmp.width;
-    unsigned char*** pixels = image_bmp.pixels;
 
     int max_y = height - ((height - WINDOW_SIZE) / 2) - ZERO_INDEX_ADJUSTMENT;
     int min_y = (height - WINDOW_SIZE) / 2 - ZERO_INDEX_ADJUSTMENT;
@@ -273,7 +556,7 @@ void calibration_mode(char* calibration_file_name, char* image_file_path) {
 
     for (int y = min_y; y < max_y; y++) {
         for (int x = min_x; x < max_x; x++) {
-            HSV hsv_values = rgb2hsv(pixels[y][x]);
+            HSV hsv_values = rgb2hsv(bmp_pixel(image_bmp, x, y));
             int hue = hsv_values.hue;
             int saturation = hsv_values.saturation;
             int value = hsv_values.value;
@@ -287,11 +570,137 @@ void calibration_mode(char* calibration_file_name, char* image_file_path) {
             }
         }
     }
-    int hue_diff = hue_difference(max_hue, min_hue);
-    int hue_mid = hue_midpoint(max_hue, min_hue);
-    int max_hue_diff = hue_diff / 2;
-
-    printf("%s %d %d %d %d\n", calibration_file_name, hue_mid, max_hue_diff, SATURATION_THRESHOLD, VALUE_THRESHOLD);
+    HueRange range;
+    range.hue_mid = hue_midpoint(max_hue, min_hue);
+    range.max_hue_diff = hue_difference(max_hue, min_hue) / 2;
 
     free_bmp(image_bmp);
+    return range;
+}
+
+// Everything the tasks of one calibration_mode call share
+typedef struct {
+    char** arguments;   // Object names and image paths, alternating
+    HueRange* ranges;   // Receives the hue window of each image
+} CalibrationJob;
+
+// Calibrate one image
+static void calibrate_task(void* argument, int image) {
+    CalibrationJob* job = argument;
+    job->ranges[image] = calibrate_image(job->arguments[2 * image + 1]);
+}
+
+// Adds calibrated objects to a store file, merging hue ranges into objects of the same name
+static void append_to_store(char* store_path, char** arguments, const HueRange* ranges, int num_images) {
+    // A missing store is created compiled; an existing one keeps its format
+    struct stat store_info;
+    int exists = stat(store_path, &store_info) == 0;
+    int compiled = !exists || is_compiled_store(store_path);
+    CalibratedObject* objects = NULL;
+    int num_objects = 0;
+    int capacity = 0;
+    if (exists) {
+        CalibrationStore store = load_calibration_store(store_path);
+        for (; num_objects < store.num_objects; num_objects++) {
+            objects = reserve_object(objects, num_objects, &capacity);
+            objects[num_objects] = store.objects[num_objects];
+        }
+        free_calibration_store(store);
+    }
+
+    for (int image = 0; image < num_images; image++) {
+        char* name = arguments[2 * image];
+        int object_num = 0;
+        while (object_num < num_objects && strcmp(objects[object_num].name, name) != 0) {
+            object_num++;
+        }
+        if (object_num == num_objects) {
+            if (num_objects == MAX_OBJECTS) {
+                fprintf(stderr, "Could not add %s to %s (at most %d objects, as object types are stored in 16 bits)\n",
+                        name, store_path, MAX_OBJECTS);
+                exit(1);
+            }
+            if (strlen(name) >= OBJECT_NAME_LENGTH) {
+                fprintf(stderr, "Could not add %s to %s (names must be under %d characters)\n", name, store_path, OBJECT_NAME_LENGTH);
+                exit(1);
+            }
+            objects = reserve_object(objects, num_objects, &capacity);
+            memset(&objects[num_objects], 0, sizeof(CalibratedObject));
+            strcpy(objects[num_objects].name, name);
+            objects[num_objects].saturation_min = SATURATION_THRESHOLD;
+            objects[num_objects].value_min = VALUE_THRESHOLD;
+            num_objects++;
+        }
+        if (!add_hue_range(&objects[object_num], ranges[image].hue_mid, ranges[image].max_hue_diff)) {
+            fprintf(stderr, "Could not add another hue range to %s (at most %d)\n", name, MAX_HUE_RANGES);
+            exit(1);
+        }
+    }
+
+    CalibrationStore store = compile_calibration_store(objects, num_objects);
+    int saved = compiled ? save_calibration_store(&store, store_path) : save_calibration_text(&store, store_path);
+    if (!saved) {
+        fprintf(stderr, "Could not write calibration store %s\n", store_path);
+        exit(1);
+    }
+    free_calibration_store(store);
+    free(objects);
+}
+
+// Takes in images and produces a line of calibration data for each, optionally adding them to a store
+void calibration_mode(char** arguments, int num_images, int num_threads, char* store_path) {
+    HueRange* ranges = malloc(num_images * sizeof(HueRange));
+    if (ranges == NULL) {
+        fprintf(stderr, "Could not allocate calibrations\n");
+        exit(1);
+    }
+
+    // Each image is calibrated on its own, so they are spread across the threads
+    ThreadPool* pool = create_thread_pool((num_threads < num_images) ? num_threads : num_images);
+    CalibrationJob job = { .arguments = arguments, .ranges = ranges };
+    run_parallel(pool, num_images, calibrate_task, &job);
+    free_thread_pool(pool);
+
+    for (int image = 0; image < num_images; image++) {
+        printf("%s %d %d %d %d\n", arguments[2 * image], ranges[image].hue_mid, ranges[image].max_hue_diff, SATURATION_THRESHOLD, VALUE_THRESHOLD);
+    }
+    if (store_path != NULL) {
+        append_to_store(store_path, arguments, ranges, num_images);
+    }
+    free(ranges);
+}
+
+// Reads the name and image pairs of calibration mode, then its options
+void parse_calibration_options(int argc, char** argv, int* num_images, int* num_threads, char** store_path) {
+    int first_pair = MODE + 1;
+    int i = first_pair;
+    while (i + 1 < argc && argv[i][0] != '-') {
+        i += 2;
+    }
+    *num_images = (i - first_pair) / 2;
+    if (*num_images == 0) {
+        error_exit(INCORRECT_INPUT);
+    }
+
+    for (; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            error_exit(INCORRECT_INPUT);
+        }
+        if (strcmp(argv[i], APPEND_OPTION) == 0) {
+            *store_path = argv[i + 1];
+        } else {
+            *num_threads = parse_thread_count(argv[i], argv[i + 1]);
+        }
+    }
+}
+
+// Compiles a calibration file into a store that is mapped instead of parsed
+void compile_mode(char* calibration_file_path, char* store_path) {
+    CalibrationStore store = load_calibration_store(calibration_file_path);
+    if (!save_calibration_store(&store, store_path)) {
+        fprintf(stderr, "Could not write calibration store %s\n", store_path);
+        exit(1);
+    }
+    printf("Compiled %d objects into %s\n", store.num_objects, store_path);
+    free_calibration_store(store);
 }
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "cam_detect.h"
+#include "colour_lut.h"
+#include "calibration_store.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define LUT_HEADER_SIZE (LUT_MAGIC_LENGTH + sizeof(uint64_t))   // Magic followed by the key
+#define LUT_SIZE ((size_t)LUT_ENTRIES * sizeof(uint16_t))       // Bytes of labels
+
+// Mix a block of bytes into a running FNV-1a hash
+static uint64_t fnv1a(uint64_t hash, const void* bytes, size_t length) {
+    const unsigned char* byte = bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= byte[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hash calibration file contents and the table format (the thresholds are in the file)
+uint64_t hash_calibration_file(char* calibration_file_path) {
+    FILE* file_pointer = fopen(calibration_file_path, "r");
+    if (file_pointer == NULL) {
+        error_exit(FILE_NOT_FOUND);
+    }
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    char buffer[STR_BUFFER_SIZE];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file_pointer)) > 0) {
+        hash = fnv1a(hash, buffer, bytes_read);
+    }
+    fclose(file_pointer);
+    return fnv1a(hash, LUT_MAGIC, LUT_MAGIC_LENGTH);
+}
+
+// Classify every 24-bit colour once so detection is a single lookup per pixel
+ColourLut build_colour_lut(const CalibrationStore* store) {
+    ColourLut lut = {NULL, 0, NULL, 0};
+    lut.labels = malloc(LUT_SIZE);
+    if (lut.labels == NULL) {
+        fprintf(stderr, "Could not allocate colour lookup table\n");
+        exit(1);
+    }
+
+    unsigned char pixel[BYTES_PER_PIXEL];
+    for (int red = 0; red < 256; red++) {
+        pixel[RED] = red;
+        for (int green = 0; green < 256; green++) {
+            pixel[GREEN] = green;
+            for (int blue = 0; blue < 256; blue++) {
+                pixel[BLUE] = blue;
+                HSV hsv_values = rgb2hsv(pixel);
+                int brightest = (red > green) ? red : green;
+                brightest = (brightest > blue) ? brightest : blue;
+                lut.labels[pack_rgb(pixel)] = match_calibration(store, hsv_values.hue, hsv_values.saturation, brightest);
+            }
+        }
+    }
+    return lut;
+}
+
+// Map a cached table if it exists and was built from the same calibration file
+static int map_cached_lut(char* cache_path, uint64_t key, ColourLut* lut) {
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat file_info;
+    size_t size = LUT_HEADER_SIZE + LUT_SIZE;
+    if (fstat(fd, &file_info) != 0 || (size_t)file_info.st_size != size) {
+        close(fd);
+        return 0;
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    uint64_t cached_key;
+    memcpy(&cached_key, (unsigned char*)mapping + LUT_MAGIC_LENGTH, sizeof(cached_key));
+    if (memcmp(mapping, LUT_MAGIC, LUT_MAGIC_LENGTH) != 0 || cached_key != key) {
+        munmap(mapping, size);
+        return 0;
+    }
+
+    lut->labels = (uint16_t*)((unsigned char*)mapping + LUT_HEADER_SIZE);
+    lut->key = key;
+    lut->mapping = mapping;
+    lut->mapping_size = size;
+    return 1;
+}
+
+// Save a table next to the calibration file; caching is best effort
+static void save_cached_lut(char* cache_path, ColourLut lut) {
+    char temp_path[STR_BUFFER_SIZE + 2 * INT_BUFFER_SIZE];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld", cache_path, (long)getpid());
+
+    FILE* file_pointer = fopen(temp_path, "wb");
+    if (file_pointer == NULL) {
+        return;
+    }
+    int ok = fwrite(LUT_MAGIC, 1, LUT_MAGIC_LENGTH, file_pointer) == LUT_MAGIC_LENGTH
+        && fwrite(&lut.key, sizeof(lut.key), 1, file_pointer) == 1
+        && fwrite(lut.labels, sizeof(uint16_t), LUT_ENTRIES, file_pointer) == LUT_ENTRIES;
+    ok = (fclose(file_pointer) == 0) && ok;
+
+    // Rename into place so other runs never see a half written table
+    if (!ok || rename(temp_path, cache_path) != 0) {
+        remove(temp_path);
+    }
+}
+
+// Reuse the table cached for this calibration file, or build and cache it
+ColourLut load_colour_lut(char* calibration_file_path, const CalibrationStore* store) {
+    uint64_t key = hash_calibration_file(calibration_file_path);
+
+    char cache_path[STR_BUFFER_SIZE];
+    snprintf(cache_path, sizeof(cache_path), "%s%s", calibration_file_path, LUT_CACHE_SUFFIX);
+
+    ColourLut lut;
+    if (map_cached_lut(cache_path, key, &lut)) {
+        return lut;
+    }
+
+    lut = build_colour_lut(store);
+    lut.key = key;
+    save_cached_lut(cache_path, lut);
+    return lut;
+}
+
+void free_colour_lut(ColourLut lut) {
+    if (lut.mapping != NULL) {
+        munmap(lut.mapping, lut.mapping_size);
+    } else {
+        free(lut.labels);
+    }
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "frame_queue.h"
+
+struct FrameQueue {
+    Frame* frames;              // Ring buffer of waiting frames
+    int capacity;
+    int first;                  // Index of the frame at the front
+    int count;
+    int closed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   // Signalled when a frame is pushed or the queue closes
+    pthread_cond_t not_full;    // Signalled when a frame is popped
+};
+
+FrameQueue* create_frame_queue(int capacity) {
+    FrameQueue* queue = calloc(1, sizeof(FrameQueue));
+    if (queue == NULL) {
+        fprintf(stderr, "Could not allocate frame queue\n");
+        exit(1);
+    }
+    queue->capacity = (capacity > 0) ? capacity : 1;
+    queue->frames = malloc(queue->capacity * sizeof(Frame));
+    if (queue->frames == NULL) {
+        fprintf(stderr, "Could not allocate frame queue\n");
+        exit(1);
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+void push_frame(FrameQueue* queue, Frame frame) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->frames[(queue->first + queue->count) % queue->capacity] = frame;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int pop_frame(FrameQueue* queue, Frame* frame) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    int popped = (queue->count > 0);
+    if (popped) {
+        *frame = queue->frames[queue->first];
+        queue->first = (queue->first + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return popped;
+}
+
+void close_frame_queue(FrameQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void free_frame_queue(FrameQueue* queue) {
+    if (queue == NULL) {
+        return;
+    }
+    Frame frame;
+    queue->closed = 1;
+    while (pop_frame(queue, &frame)) {
+        free_bmp(frame.image);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->frames);
+    free(queue);
+}
@@ -13,10 +13,19 @@ int main(int argc, char** argv) {
     }
     
     char operation_mode = argv[MODE][FIRST_INDEX];  // First character of the mode argument
+    if (strcmp(argv[MODE], BENCH_MODE_NAME) == 0) {
+        operation_mode = BENCH;
+    } else if (strcmp(argv[MODE], COMPILE_MODE_NAME) == 0) {
+        operation_mode = COMPILE;
+    }
 
-    // Define calibration data array and counter at the beginning of main
-    char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA];
-    int num_calibrations = 0;
+    int num_threads = default_thread_count();
+    char* output_directory = NULL;
+    int full_interval = 0;
+    int show_timing = 0;
+    int iterations = DEFAULT_BENCH_ITERATIONS;
+    int num_images = 0;
+    char* store_path = NULL;
 
     // Switch based on the chosen mode
     switch (operation_mode) {
@@ -25,22 +34,61 @@ int main(int argc, char** argv) {
             if (argc != ARGC_SHOW_CALIBRATION) {
                 error_exit(INCORRECT_INPUT);
             }
-            load_calibration_data(argv[2], data, &num_calibrations);  
-            display_calibration_file(argv[2]);                        
+            display_calibration_file(argv[2]);
             break;
 
         case DETECT:
-            if (argc != ARGC_DETECT) {
+            if (argc < ARGC_DETECT) {
                 error_exit(INCORRECT_INPUT);
             }
-            detection_mode(argv[2], argv[3]);                   
+            parse_detect_options(argc, argv, &num_threads, &show_timing);
+            detection_mode(argv[2], argv[3], num_threads, show_timing);
             break;
 
         case CALIBRATE:
-            if (argc != ARGC_CALIBRATION) {
+            if (argc < ARGC_CALIBRATION) {
+                error_exit(INCORRECT_INPUT);
+            }
+            parse_calibration_options(argc, argv, &num_images, &num_threads, &store_path);
+            calibration_mode(argv + 2, num_images, num_threads, store_path);
+            break;
+
+        case COMPILE:
+            if (argc != ARGC_COMPILE) {
+                error_exit(INCORRECT_INPUT);
+            }
+            compile_mode(argv[2], argv[3]);
+            break;
+
+        case SELF_CHECK:
+            if (argc < MIN_ARGC_SELF_CHECK) {
                 error_exit(INCORRECT_INPUT);
             }
-            calibration_mode(argv[2], argv[3]);                   
+            self_check_mode(argv[2], argv + 3, argc - 3);
+            break;
+
+        case BATCH:
+            if (argc < ARGC_SEQUENCE) {
+                error_exit(INCORRECT_INPUT);
+            }
+            parse_sequence_options(argc, argv, &num_threads, &output_directory, NULL);
+            batch_mode(argv[2], argv[3], num_threads, output_directory);
+            break;
+
+        case TEMPORAL:
+            if (argc < ARGC_SEQUENCE) {
+                error_exit(INCORRECT_INPUT);
+            }
+            parse_sequence_options(argc, argv, &num_threads, &output_directory, &full_interval);
+            temporal_mode(argv[2], argv[3], num_threads, output_directory, full_interval);
+            break;
+
+        case BENCH:
+            if (argc < ARGC_BENCH) {
+                error_exit(INCORRECT_INPUT);
+            }
+            parse_bench_options(argc, argv, &num_threads, &iterations);
+            bench_mode(argv[2], num_threads, iterations);
             break;
 
         // Other errors
@@ -49,13 +97,6 @@ int main(int argc, char** argv) {
             break;
     }
 
-    // Free allocated memory for calibration data in `data`
-    for (int i = 0; i < num_calibrations; i++) {
-        for (int j = 0; j < LEN_CALIBRATION_DATA; j++) {
-            free(data[i][j]);
-        }
-    }
-
     // End successfully
     return 0;
 }
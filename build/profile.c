@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "profile.h"
+
+#define MILLISECONDS 1000.0     // Milliseconds per second
+#define INITIAL_FRAMES 64       // Starting capacity of a set of stage times
+
+static const char* stage_names[NUM_STAGES] = { "read", "threshold", "label", "classify", "write" };
+
+// Allocations made through the wrappers below (shared by every thread)
+static unsigned long num_allocations = 0;
+
+// The linker sends the program's own allocation calls here (-Wl,--wrap=malloc
+// and so on), and __real_* reaches the usual allocator
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size) {
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+    __atomic_fetch_add(&num_allocations, 1, __ATOMIC_RELAXED);
+    return __real_aligned_alloc(alignment, size);
+}
+
+unsigned long allocation_count(void) {
+    return __atomic_load_n(&num_allocations, __ATOMIC_RELAXED);
+}
+
+long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+double clock_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+StageTimes create_stage_times(int num_frames) {
+    StageTimes times = { .samples = NULL, .count = 0, .capacity = 0 };
+    if (num_frames > 0) {
+        times.capacity = num_frames;
+        times.samples = malloc((size_t)num_frames * NUM_STAGES * sizeof(double));
+        if (times.samples == NULL) {
+            fprintf(stderr, "Could not allocate stage times\n");
+            exit(1);
+        }
+    }
+    return times;
+}
+
+void free_stage_times(StageTimes* times) {
+    free(times->samples);
+    times->samples = NULL;
+    times->count = 0;
+    times->capacity = 0;
+}
+
+void start_frame_times(StageTimes* times) {
+    if (times == NULL) {
+        return;
+    }
+    if (times->count == times->capacity) {
+        times->capacity = (times->capacity > 0) ? times->capacity * 2 : INITIAL_FRAMES;
+        times->samples = realloc(times->samples, (size_t)times->capacity * NUM_STAGES * sizeof(double));
+        if (times->samples == NULL) {
+            fprintf(stderr, "Could not allocate stage times\n");
+            exit(1);
+        }
+    }
+    memset(times->samples + (size_t)times->count * NUM_STAGES, 0, NUM_STAGES * sizeof(double));
+    times->count++;
+}
+
+void record_stage(StageTimes* times, Stage stage, double seconds) {
+    if (times == NULL || times->count == 0) {
+        return;
+    }
+    times->samples[(size_t)(times->count - 1) * NUM_STAGES + stage] += seconds;
+}
+
+// Sort helper for percentiles
+static int compare_doubles(const void* first, const void* second) {
+    double a = *(const double*)first;
+    double b = *(const double*)second;
+    return (a > b) - (a < b);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double* sorted, int count, double percent) {
+    int rank = (int)(percent / 100.0 * count + 0.999999);
+    rank = (rank < 1) ? 1 : (rank > count) ? count : rank;
+    return sorted[rank - 1];
+}
+
+// Print the summary of one stage's samples (in seconds, sorted in place)
+static void print_summary_json(FILE* stream, const char* name, double* values, int count, double megapixels) {
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    qsort(values, count, sizeof(double), compare_doubles);
+    double mean = (count > 0) ? sum / count : 0.0;
+    fprintf(stream, "\"%s\": {\"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f, \"megapixels_per_second\": %.2f}",
+            name, mean * MILLISECONDS,
+            (count > 0) ? percentile(values, count, 50) * MILLISECONDS : 0.0,
+            (count > 0) ? percentile(values, count, 90) * MILLISECONDS : 0.0,
+            (count > 0) ? percentile(values, count, 99) * MILLISECONDS : 0.0,
+            (count > 0) ? values[count - 1] * MILLISECONDS : 0.0,
+            (mean > 0.0) ? megapixels / mean : 0.0);
+}
+
+void print_stage_json(FILE* stream, const StageTimes* times, double megapixels) {
+    double* values = malloc(((size_t)times->count + 1) * sizeof(double));
+    if (values == NULL) {
+        fprintf(stderr, "Could not allocate stage times\n");
+        exit(1);
+    }
+
+    fprintf(stream, "{");
+    for (int stage = 0; stage < NUM_STAGES; stage++) {
+        for (int frame = 0; frame < times->count; frame++) {
+            values[frame] = times->samples[(size_t)frame * NUM_STAGES + stage];
+        }
+        print_summary_json(stream, stage_names[stage], values, times->count, megapixels);
+        fprintf(stream, ", ");
+    }
+    for (int frame = 0; frame < times->count; frame++) {
+        values[frame] = 0.0;
+        for (int stage = 0; stage < NUM_STAGES; stage++) {
+            values[frame] += times->samples[(size_t)frame * NUM_STAGES + stage];
+        }
+    }
+    print_summary_json(stream, "total", values, times->count, megapixels);
+    fprintf(stream, "}");
+    free(values);
+}
+
+void print_json_string(FILE* stream, const char* text) {
+    fputc('"', stream);
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(stream, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(stream, "\\u%04x", *c);
+        } else {
+            fputc(*c, stream);
+        }
+    }
+    fputc('"', stream);
+}
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "bitmap.h"
+#include "regions.h"
+
+// Exit if a region table could not grow
+static void assert_alloc(const void* pointer) {
+    if (pointer == NULL) {
+        fprintf(stderr, "Could not allocate region table\n");
+        exit(1);
+    }
+}
+
+// Empty statistics: the bounding box starts inverted so any pixel replaces it
+static const Region empty_region = {
+    .min_x = INT_MAX, .max_x = -1, .min_y = INT_MAX, .max_y = -1,
+    .area = 0, .sum_x = 0, .sum_y = 0, .first_x = INT_MAX, .object_type = 0,
+};
+
+RegionTable create_region_table(void) {
+    RegionTable table;
+    memset(&table, 0, sizeof(table));
+    return table;
+}
+
+void reset_region_table(RegionTable* table) {
+    table->count = 0;
+}
+
+void free_region_table(RegionTable* table) {
+    for (int band = 0; band < table->num_bands; band++) {
+        free(table->bands[band].parent);
+        free(table->bands[band].provisional);
+        free(table->bands[band].type_counts.slots);
+    }
+    free(table->bands);
+    free(table->band_offsets);
+    free(table->regions);
+    free(table->type_counts.slots);
+    free(table->parent);
+    free(table->final_label);
+    memset(table, 0, sizeof(*table));
+}
+
+void region_centroid(const Region* region, double* x, double* y) {
+    *x = (region->area > 0) ? (double)region->sum_x / region->area : 0.0;
+    *y = (region->area > 0) ? (double)region->sum_y / region->area : 0.0;
+}
+
+// Append an empty region, growing the table if full
+static int add_region(RegionTable* table) {
+    if (table->count == table->capacity) {
+        int capacity = (table->capacity > 0) ? table->capacity * 2 : INITIAL_REGIONS;
+        table->regions = realloc(table->regions, capacity * sizeof(Region));
+        assert_alloc(table->regions);
+        table->capacity = capacity;
+    }
+    int region = table->count++;
+    table->regions[region] = empty_region;
+    return region;
+}
+
+// Empty a type count table, keeping its slots
+static void clear_type_counts(TypeCountTable* counts) {
+    if (counts->used > 0) {
+        memset(counts->slots, 0, counts->capacity * sizeof(TypeCount));
+        counts->used = 0;
+    }
+}
+
+// Slot holding a (region, object type) pair, or the empty slot it would go in
+static TypeCount* find_type_count(const TypeCountTable* counts, unsigned int region, unsigned int object_type) {
+    unsigned int mask = counts->capacity - 1;
+    unsigned int slot = (region * 0x9E3779B1u ^ object_type * 0x85EBCA6Bu) & mask;
+    while (counts->slots[slot].region != NO_REGION
+           && (counts->slots[slot].region != region || counts->slots[slot].object_type != object_type)) {
+        slot = (slot + 1) & mask;
+    }
+    return &counts->slots[slot];
+}
+
+// Add pixels of an object type to a region's count, growing the table to stay at most half full
+static void add_type_count(TypeCountTable* counts, unsigned int region, unsigned int object_type, unsigned int count) {
+    if (2 * (counts->used + 1) > counts->capacity) {
+        TypeCountTable grown = {
+            .capacity = (counts->capacity > 0) ? counts->capacity * 2 : INITIAL_REGIONS,
+            .used = counts->used,
+        };
+        grown.slots = calloc(grown.capacity, sizeof(TypeCount));
+        assert_alloc(grown.slots);
+        for (unsigned int slot = 0; slot < counts->capacity; slot++) {
+            if (counts->slots[slot].region != NO_REGION) {
+                *find_type_count(&grown, counts->slots[slot].region, counts->slots[slot].object_type) = counts->slots[slot];
+            }
+        }
+        free(counts->slots);
+        *counts = grown;
+    }
+    TypeCount* entry = find_type_count(counts, region, object_type);
+    if (entry->region == NO_REGION) {
+        entry->region = region;
+        entry->object_type = object_type;
+        counts->used++;
+    }
+    entry->count += count;
+}
+
+// Hand out a new provisional label that is its own union-find root
+static unsigned int new_provisional(LabelScratch* scratch) {
+    if (scratch->count >= scratch->capacity) {
+        unsigned int capacity = (scratch->capacity > 0) ? scratch->capacity * 2 : INITIAL_REGIONS;
+        scratch->parent = realloc(scratch->parent, capacity * sizeof(unsigned int));
+        scratch->provisional = realloc(scratch->provisional, capacity * sizeof(Region));
+        assert_alloc(scratch->parent);
+        assert_alloc(scratch->provisional);
+        scratch->capacity = capacity;
+    }
+    unsigned int label = scratch->count++;
+    scratch->parent[label] = label;
+    scratch->provisional[label] = empty_region;
+    return label;
+}
+
+// Make sure there is scratch space for every band
+static void reserve_bands(RegionTable* table, int num_bands) {
+    if (num_bands <= table->num_bands) {
+        return;
+    }
+    table->bands = realloc(table->bands, num_bands * sizeof(LabelScratch));
+    table->band_offsets = realloc(table->band_offsets, num_bands * sizeof(unsigned int));
+    assert_alloc(table->bands);
+    assert_alloc(table->band_offsets);
+    memset(table->bands + table->num_bands, 0, (num_bands - table->num_bands) * sizeof(LabelScratch));
+    table->num_bands = num_bands;
+}
+
+// Make sure the global union-find arrays hold num_labels labels
+static void reserve_global_labels(RegionTable* table, unsigned int num_labels) {
+    if (num_labels <= table->global_capacity) {
+        return;
+    }
+    unsigned int capacity = (table->global_capacity > 0) ? table->global_capacity : INITIAL_REGIONS;
+    while (capacity < num_labels) {
+        capacity *= 2;
+    }
+    table->parent = realloc(table->parent, capacity * sizeof(unsigned int));
+    table->final_label = realloc(table->final_label, capacity * sizeof(unsigned int));
+    assert_alloc(table->parent);
+    assert_alloc(table->final_label);
+    table->global_capacity = capacity;
+}
+
+// Root of a provisional label, halving the path on the way up
+static unsigned int find_root(unsigned int* parent, unsigned int label) {
+    while (parent[label] != label) {
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
+
+// Join two provisional labels, keeping the smaller (earlier) root
+static unsigned int union_labels(unsigned int* parent, unsigned int first, unsigned int second) {
+    unsigned int first_root = find_root(parent, first);
+    unsigned int second_root = find_root(parent, second);
+    if (first_root < second_root) {
+        parent[second_root] = first_root;
+        return first_root;
+    }
+    parent[first_root] = second_root;
+    return second_root;
+}
+
+// Grow a region's statistics by one pixel
+static inline void add_pixel(Region* region, int x, int y) {
+    if (x < region->min_x) {
+        region->min_x = x;
+    }
+    if (x > region->max_x) {
+        region->max_x = x;
+    }
+    if (y < region->min_y) {
+        region->min_y = y;
+    }
+    if (y > region->max_y) {
+        region->max_y = y;
+    }
+    if (region->area == 0) {
+        region->first_x = x;    // Pixels arrive in scan order
+    }
+    region->area++;
+    region->sum_x += x;
+    region->sum_y += y;
+}
+
+// Fold the statistics of one region into another
+static void merge_stats(Region* into, const Region* from) {
+    if (from->min_y < into->min_y || (from->min_y == into->min_y && from->first_x < into->first_x)) {
+        into->first_x = from->first_x;
+    }
+    into->min_x = (from->min_x < into->min_x) ? from->min_x : into->min_x;
+    into->max_x = (from->max_x > into->max_x) ? from->max_x : into->max_x;
+    into->min_y = (from->min_y < into->min_y) ? from->min_y : into->min_y;
+    into->max_y = (from->max_y > into->max_y) ? from->max_y : into->max_y;
+    into->area += from->area;
+    into->sum_x += from->sum_x;
+    into->sum_y += from->sum_y;
+}
+
+// Everything the band tasks of one labelling call share
+typedef struct {
+    const ThresholdEngine* engine;  // Thresholds each row first (NULL if already thresholded)
+    Bmp image_bmp;
+    Bmp threshold_image;
+    RegionTable* table;
+    int num_bands;
+
+    // Window being labelled, and where its labels go (window_width per row)
+    int min_x;
+    int min_y;
+    int window_width;
+    int window_height;
+    unsigned int* labels;
+    int skip_labelled;              // Leave pixels already in the region plane alone
+} LabelJob;
+
+// First row of a band, relative to the window (the band ends where the next one starts)
+static int band_start(const LabelJob* job, int band) {
+    return (int)((long)job->window_height * band / job->num_bands);
+}
+
+// Pass 1 over one band: threshold its rows, hand out provisional labels, record
+// which ones touch and gather their statistics. The band's top row ignores the
+// row above it; those joins are made afterwards by join_bands()
+static void label_band(void* argument, int band) {
+    LabelJob* job = argument;
+    Bmp threshold_image = job->threshold_image;
+    LabelScratch* scratch = &job->table->bands[band];
+    int width = job->window_width;
+    int first_row = band_start(job, band);
+    int end_row = band_start(job, band + 1);
+
+    scratch->count = 1; // label 0 is the background
+    for (int row_num = first_row; row_num < end_row; row_num++) {
+        int y = job->min_y + row_num;
+        unsigned char* pixel = bmp_pixel(threshold_image, job->min_x, y);
+        const unsigned int* labelled = threshold_image.region + bmp_index(threshold_image, job->min_x, y);
+        unsigned int* row = job->labels + (size_t)row_num * width;
+        const unsigned int* row_above = (row_num > first_row) ? row - width : NULL;
+
+        if (job->engine != NULL) {
+            job->engine->threshold_row(job->engine, bmp_pixel(job->image_bmp, job->min_x, y), width,
+                                       threshold_image.object_type + bmp_index(threshold_image, job->min_x, y), pixel);
+        }
+
+        for (int x = 0; x < width; x++, pixel += BYTES_PER_PIXEL) {
+            if (pixel[RED] != white.red_value || (job->skip_labelled && labelled[x] != NO_REGION)) {
+                row[x] = NO_REGION;
+                continue;
+            }
+            unsigned int left = (x > 0) ? row[x - 1] : NO_REGION;
+            unsigned int above = (row_above != NULL) ? row_above[x] : NO_REGION;
+
+            unsigned int label;
+            if (left == NO_REGION && above == NO_REGION) {
+                label = new_provisional(scratch);
+            } else if (above == NO_REGION || above == left) {
+                label = left;
+            } else if (left == NO_REGION) {
+                label = above;
+            } else {
+                union_labels(scratch->parent, left, above);
+                label = left;
+            }
+            row[x] = label;
+            add_pixel(&scratch->provisional[label], job->min_x + x, y);
+        }
+    }
+}
+
+// Number every band's provisional labels globally (band by band, so global
+// labels stay in scan order) and join the labels touching across band edges
+static void join_bands(LabelJob* job) {
+    RegionTable* table = job->table;
+    int width = job->window_width;
+
+    unsigned int num_labels = 1;
+    for (int band = 0; band < job->num_bands; band++) {
+        table->band_offsets[band] = num_labels - 1;
+        num_labels += table->bands[band].count - 1;
+    }
+    reserve_global_labels(table, num_labels);
+
+    for (int band = 0; band < job->num_bands; band++) {
+        const LabelScratch* scratch = &table->bands[band];
+        unsigned int offset = table->band_offsets[band];
+        for (unsigned int label = 1; label < scratch->count; label++) {
+            table->parent[offset + label] = offset + scratch->parent[label];
+        }
+    }
+
+    for (int band = 1; band < job->num_bands; band++) {
+        const unsigned int* row = job->labels + (size_t)band_start(job, band) * width;
+        const unsigned int* row_above = row - width;
+        for (int x = 0; x < width; x++) {
+            if (row[x] != NO_REGION && row_above[x] != NO_REGION) {
+                union_labels(table->parent, table->band_offsets[band] + row[x],
+                             table->band_offsets[band - 1] + row_above[x]);
+            }
+        }
+    }
+}
+
+// Pass 2 over one band: rewrite provisional labels as regions and count each
+// region's object types into the band's own table, a run of equal pairs at a time
+static void relabel_band(void* argument, int band) {
+    LabelJob* job = argument;
+    Bmp threshold_image = job->threshold_image;
+    RegionTable* table = job->table;
+    TypeCountTable* counts = &table->bands[band].type_counts;
+    const unsigned int* final_label = table->final_label + table->band_offsets[band];
+    int width = job->window_width;
+    int end_row = band_start(job, band + 1);
+
+    clear_type_counts(counts);
+    unsigned int run_region = NO_REGION;
+    unsigned int run_type = 0;
+    unsigned int run_length = 0;
+    for (int row_num = band_start(job, band); row_num < end_row; row_num++) {
+        unsigned int* row = job->labels + (size_t)row_num * width;
+        const unsigned short* object_type = threshold_image.object_type + bmp_index(threshold_image, job->min_x, job->min_y + row_num);
+        for (int x = 0; x < width; x++) {
+            if (row[x] != NO_REGION) {
+                unsigned int region = final_label[row[x]];
+                row[x] = region;
+                if (region != run_region || object_type[x] != run_type) {
+                    if (run_length > 0) {
+                        add_type_count(counts, run_region, run_type, run_length);
+                    }
+                    run_region = region;
+                    run_type = object_type[x];
+                    run_length = 0;
+                }
+                run_length++;
+            }
+        }
+    }
+    if (run_length > 0) {
+        add_type_count(counts, run_region, run_type, run_length);
+    }
+}
+
+// Give a region an object type if it has more pixels of it than of its current
+// one (or as many, and the type is earlier). Regions start at type 0, whose
+// count is 0 if it is not in the table, so they end with their most common type
+static void pick_object_type(RegionTable* table, const TypeCountTable* counts, const TypeCount* entry) {
+    Region* region = &table->regions[entry->region - 1];
+    unsigned int dominant = find_type_count(counts, entry->region, region->object_type)->count;
+    if (entry->count > dominant || (entry->count == dominant && (int)entry->object_type < region->object_type)) {
+        region->object_type = entry->object_type;
+    }
+}
+
+// Two-pass connected component labelling over bands of rows:
+// pass 1 labels each band on its own; the bands' labels are then joined and
+// resolved to regions numbered in scan order; pass 2 rewrites the labels and
+// counts each region's object types
+static int label_job(ThreadPool* pool, LabelJob* job) {
+    RegionTable* table = job->table;
+    int num_bands = thread_pool_size(pool);
+    if (num_bands > job->window_height) {
+        num_bands = job->window_height;
+    }
+    if (num_bands < 1) {
+        num_bands = 1;
+    }
+    job->num_bands = num_bands;
+    reset_region_table(table);
+    reserve_bands(table, num_bands);
+
+    run_parallel(pool, num_bands, label_band, job);
+    join_bands(job);
+
+    // Roots are the smallest label of each component, so visiting labels in
+    // order numbers regions by their first pixel in scan order
+    for (int band = 0; band < num_bands; band++) {
+        const LabelScratch* scratch = &table->bands[band];
+        unsigned int offset = table->band_offsets[band];
+        for (unsigned int local = 1; local < scratch->count; local++) {
+            unsigned int label = offset + local;
+            unsigned int root = find_root(table->parent, label);
+            if (root == label) {
+                table->final_label[label] = add_region(table) + 1;
+            } else {
+                table->final_label[label] = table->final_label[root];
+            }
+            merge_stats(&table->regions[table->final_label[label] - 1], &scratch->provisional[local]);
+        }
+    }
+
+    run_parallel(pool, num_bands, relabel_band, job);
+
+    // A region inside one band has all its counts in that band's table. The
+    // counts of regions crossing band edges are added together first
+    clear_type_counts(&table->type_counts);
+    for (int band = 0; band < num_bands; band++) {
+        const TypeCountTable* counts = &table->bands[band].type_counts;
+        int first_y = job->min_y + band_start(job, band);
+        int end_y = job->min_y + band_start(job, band + 1);
+        for (unsigned int slot = 0; slot < counts->capacity; slot++) {
+            const TypeCount* entry = &counts->slots[slot];
+            if (entry->region == NO_REGION) {
+                continue;
+            }
+            const Region* region = &table->regions[entry->region - 1];
+            if (region->min_y >= first_y && region->max_y < end_y) {
+                pick_object_type(table, counts, entry);
+            } else {
+                add_type_count(&table->type_counts, entry->region, entry->object_type, entry->count);
+            }
+        }
+    }
+    for (unsigned int slot = 0; slot < table->type_counts.capacity; slot++) {
+        if (table->type_counts.slots[slot].region != NO_REGION) {
+            pick_object_type(table, &table->type_counts, &table->type_counts.slots[slot]);
+        }
+    }
+    return table->count;
+}
+
+int threshold_and_label(ThreadPool* pool, const ThresholdEngine* engine, Bmp image_bmp, Bmp threshold_image, RegionTable* table) {
+    LabelJob job = {
+        .engine = engine,
+        .image_bmp = image_bmp,
+        .threshold_image = threshold_image,
+        .table = table,
+        .min_x = 0,
+        .min_y = 0,
+        .window_width = (int)threshold_image.width,
+        .window_height = (int)threshold_image.height,
+        .labels = threshold_image.region,
+        .skip_labelled = 0,
+    };
+    return label_job(pool, &job);
+}
+
+int label_window(ThreadPool* pool, Bmp threshold_image, int min_x, int min_y, int max_x, int max_y, unsigned int* window_labels, RegionTable* table) {
+    LabelJob job = {
+        .engine = NULL,
+        .threshold_image = threshold_image,
+        .table = table,
+        .min_x = min_x,
+        .min_y = min_y,
+        .window_width = max_x - min_x + 1,
+        .window_height = max_y - min_y + 1,
+        .labels = window_labels,
+        .skip_labelled = 1,
+    };
+    return label_job(pool, &job);
+}
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "temporal.h"
+
+// Exit if the temporal state could not grow
+static void assert_alloc(const void* pointer) {
+    if (pointer == NULL) {
+        fprintf(stderr, "Could not allocate temporal state\n");
+        exit(1);
+    }
+}
+
+TemporalState create_temporal_state(int full_interval) {
+    TemporalState state;
+    memset(&state, 0, sizeof(state));
+    state.full_interval = full_interval;
+    state.window_regions = create_region_table();
+    state.detections = create_region_table();
+    return state;
+}
+
+void free_temporal_state(TemporalState* state) {
+    if (state->previous.header != NULL) {
+        free_bmp(state->previous);
+    }
+    if (state->threshold_image.header != NULL) {
+        free_bmp(state->threshold_image);
+    }
+    free(state->regions);
+    free(state->active);
+    free(state->affected);
+    free(state->free_ids);
+    free(state->dirty);
+    free(state->near_dirty);
+    free(state->window_labels);
+    free(state->new_ids);
+    free_region_table(&state->window_regions);
+    free_region_table(&state->detections);
+    memset(state, 0, sizeof(*state));
+}
+
+// Make sure region ids up to num_ids can be stored
+static void reserve_ids(TemporalState* state, unsigned int num_ids) {
+    if (num_ids < state->id_capacity) {
+        return;
+    }
+    unsigned int capacity = (state->id_capacity > 0) ? state->id_capacity : INITIAL_REGIONS;
+    while (capacity <= num_ids) {
+        capacity *= 2;
+    }
+    state->regions = realloc(state->regions, capacity * sizeof(Region));
+    state->active = realloc(state->active, capacity);
+    state->affected = realloc(state->affected, capacity);
+    state->free_ids = realloc(state->free_ids, capacity * sizeof(unsigned int));
+    assert_alloc(state->regions);
+    assert_alloc(state->active);
+    assert_alloc(state->affected);
+    assert_alloc(state->free_ids);
+    memset(state->active + state->id_capacity, 0, capacity - state->id_capacity);
+    state->id_capacity = capacity;
+}
+
+// Hand out a region id for a region, reusing freed ids first
+static unsigned int add_region_id(TemporalState* state, const Region* region) {
+    unsigned int id;
+    if (state->num_free > 0) {
+        id = state->free_ids[--state->num_free];
+    } else {
+        reserve_ids(state, state->num_ids + 1);
+        id = ++state->num_ids;
+    }
+    state->regions[id - 1] = *region;
+    state->active[id] = 1;
+    return id;
+}
+
+// Sort helper putting regions in the scan order of their first pixel
+static int compare_scan_order(const void* first, const void* second) {
+    const Region* a = first;
+    const Region* b = second;
+    if (a->min_y != b->min_y) {
+        return (a->min_y < b->min_y) ? -1 : 1;
+    }
+    return (a->first_x > b->first_x) - (a->first_x < b->first_x);
+}
+
+// List the regions in use in scan order, which is the order labelling the whole frame gives
+static void list_detections(TemporalState* state) {
+    RegionTable* detections = &state->detections;
+    if (detections->capacity < (int)state->num_ids) {
+        detections->capacity = (int)state->num_ids;
+        detections->regions = realloc(detections->regions, detections->capacity * sizeof(Region));
+        assert_alloc(detections->regions);
+    }
+    detections->count = 0;
+    for (unsigned int id = 1; id <= state->num_ids; id++) {
+        if (state->active[id]) {
+            detections->regions[detections->count++] = state->regions[id - 1];
+        }
+    }
+    qsort(detections->regions, detections->count, sizeof(Region), compare_scan_order);
+}
+
+// Threshold and label the whole frame, giving region k the id k + 1
+static void detect_whole_frame(TemporalState* state, ThreadPool* pool, const ThresholdEngine* engine, Bmp frame) {
+    state->previous = reuse_bmp(frame, state->previous);
+    memcpy(state->previous.pixels, frame.pixels, (size_t)frame.stride * frame.height);
+    state->threshold_image = add_planes(reuse_bmp(frame, state->threshold_image));
+
+    RegionTable* table = &state->window_regions;
+    threshold_and_label(pool, engine, frame, state->threshold_image, table);
+
+    state->num_ids = 0;
+    state->num_free = 0;
+    reserve_ids(state, table->count);
+    memset(state->active, 0, state->id_capacity);
+    for (int region = 0; region < table->count; region++) {
+        add_region_id(state, &table->regions[region]);
+    }
+
+    state->tiles_x = (frame.width + TILE_SIZE - 1) / TILE_SIZE;
+    state->tiles_y = (frame.height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t num_tiles = (size_t)state->tiles_x * state->tiles_y;
+    state->dirty = realloc(state->dirty, num_tiles);
+    state->near_dirty = realloc(state->near_dirty, num_tiles);
+    assert_alloc(state->dirty);
+    assert_alloc(state->near_dirty);
+}
+
+// Everything the tile row tasks of one frame share
+typedef struct {
+    TemporalState* state;
+    const ThresholdEngine* engine;
+    Bmp frame;
+} TileJob;
+
+// Find the tiles of one tile row that changed, bringing the previous frame up
+// to date and thresholding the changed tiles again
+static void update_tile_row(void* argument, int tile_y) {
+    TileJob* job = argument;
+    TemporalState* state = job->state;
+    Bmp frame = job->frame;
+    Bmp previous = state->previous;
+    Bmp threshold_image = state->threshold_image;
+    unsigned char* dirty = state->dirty + (size_t)tile_y * state->tiles_x;
+    int min_y = tile_y * TILE_SIZE;
+    int end_y = (min_y + TILE_SIZE < (int)frame.height) ? min_y + TILE_SIZE : (int)frame.height;
+
+    for (int tile_x = 0; tile_x < state->tiles_x; tile_x++) {
+        int min_x = tile_x * TILE_SIZE;
+        int tile_width = (min_x + TILE_SIZE < (int)frame.width) ? TILE_SIZE : (int)frame.width - min_x;
+        size_t row_bytes = (size_t)tile_width * BYTES_PER_PIXEL;
+
+        dirty[tile_x] = 0;
+        for (int y = min_y; y < end_y; y++) {
+            if (memcmp(bmp_pixel(frame, min_x, y), bmp_pixel(previous, min_x, y), row_bytes) != 0) {
+                dirty[tile_x] = 1;
+                break;
+            }
+        }
+        if (dirty[tile_x]) {
+            for (int y = min_y; y < end_y; y++) {
+                memcpy(bmp_pixel(previous, min_x, y), bmp_pixel(frame, min_x, y), row_bytes);
+            }
+        }
+    }
+
+    // Threshold each run of neighbouring changed tiles a row at a time
+    for (int tile_x = 0; tile_x < state->tiles_x; tile_x++) {
+        if (!dirty[tile_x]) {
+            continue;
+        }
+        int end_tile = tile_x;
+        while (end_tile < state->tiles_x && dirty[end_tile]) {
+            end_tile++;
+        }
+        int min_x = tile_x * TILE_SIZE;
+        int end_x = (end_tile * TILE_SIZE < (int)frame.width) ? end_tile * TILE_SIZE : (int)frame.width;
+        for (int y = min_y; y < end_y; y++) {
+            job->engine->threshold_row(job->engine, bmp_pixel(frame, min_x, y), end_x - min_x,
+                                       threshold_image.object_type + bmp_index(threshold_image, min_x, y),
+                                       bmp_pixel(threshold_image, min_x, y));
+        }
+        tile_x = end_tile;
+    }
+}
+
+// Mark the tiles that changed or touch one that did (including diagonally)
+static void mark_near_dirty(TemporalState* state) {
+    state->num_dirty = 0;
+    for (int tile_y = 0; tile_y < state->tiles_y; tile_y++) {
+        for (int tile_x = 0; tile_x < state->tiles_x; tile_x++) {
+            int near = 0;
+            for (int y = tile_y - 1; y <= tile_y + 1 && !near; y++) {
+                for (int x = tile_x - 1; x <= tile_x + 1 && !near; x++) {
+                    if (y >= 0 && y < state->tiles_y && x >= 0 && x < state->tiles_x) {
+                        near = state->dirty[(size_t)y * state->tiles_x + x];
+                    }
+                }
+            }
+            state->near_dirty[(size_t)tile_y * state->tiles_x + tile_x] = near;
+            state->num_dirty += state->dirty[(size_t)tile_y * state->tiles_x + tile_x];
+        }
+    }
+}
+
+// Grow a window (inclusive bounds) to hold a box
+static void grow_window(int window[4], int min_x, int min_y, int max_x, int max_y) {
+    window[0] = (min_x < window[0]) ? min_x : window[0];
+    window[1] = (min_y < window[1]) ? min_y : window[1];
+    window[2] = (max_x > window[2]) ? max_x : window[2];
+    window[3] = (max_y > window[3]) ? max_y : window[3];
+}
+
+// Relabel the regions near the changed tiles: every region with a pixel in a
+// tile near a change is dropped, then the window holding those tiles and
+// regions is labelled again. Regions elsewhere cannot touch a changed pixel or
+// a dropped region (they would have been the same region), so they are kept
+static void relabel_near_changes(TemporalState* state, ThreadPool* pool) {
+    Bmp threshold_image = state->threshold_image;
+    int width = threshold_image.width;
+    int height = threshold_image.height;
+    int window[4] = { width, height, -1, -1 };
+
+    memset(state->affected, 0, state->num_ids + 1);
+    for (int tile_y = 0; tile_y < state->tiles_y; tile_y++) {
+        for (int tile_x = 0; tile_x < state->tiles_x; tile_x++) {
+            if (!state->near_dirty[(size_t)tile_y * state->tiles_x + tile_x]) {
+                continue;
+            }
+            int min_x = tile_x * TILE_SIZE;
+            int min_y = tile_y * TILE_SIZE;
+            int max_x = (min_x + TILE_SIZE < width) ? min_x + TILE_SIZE - 1 : width - 1;
+            int max_y = (min_y + TILE_SIZE < height) ? min_y + TILE_SIZE - 1 : height - 1;
+            grow_window(window, min_x, min_y, max_x, max_y);
+            for (int y = min_y; y <= max_y; y++) {
+                const unsigned int* ids = threshold_image.region + bmp_index(threshold_image, 0, y);
+                for (int x = min_x; x <= max_x; x++) {
+                    state->affected[ids[x]] = 1;
+                }
+            }
+        }
+    }
+    state->affected[NO_REGION] = 0;
+
+    for (unsigned int id = 1; id <= state->num_ids; id++) {
+        if (state->affected[id]) {
+            const Region* region = &state->regions[id - 1];
+            grow_window(window, region->min_x, region->min_y, region->max_x, region->max_y);
+            state->active[id] = 0;
+            state->free_ids[state->num_free++] = id;
+        }
+    }
+
+    // Drop the affected regions from the region plane
+    for (int y = window[1]; y <= window[3]; y++) {
+        unsigned int* ids = threshold_image.region + bmp_index(threshold_image, 0, y);
+        for (int x = window[0]; x <= window[2]; x++) {
+            if (state->affected[ids[x]]) {
+                ids[x] = NO_REGION;
+            }
+        }
+    }
+
+    int window_width = window[2] - window[0] + 1;
+    size_t window_size = (size_t)window_width * (window[3] - window[1] + 1);
+    if (window_size > state->window_capacity) {
+        state->window_labels = realloc(state->window_labels, window_size * sizeof(unsigned int));
+        assert_alloc(state->window_labels);
+        state->window_capacity = window_size;
+    }
+    RegionTable* table = &state->window_regions;
+    label_window(pool, threshold_image, window[0], window[1], window[2], window[3], state->window_labels, table);
+
+    if (table->count > state->new_ids_capacity) {
+        state->new_ids_capacity = table->count;
+        state->new_ids = realloc(state->new_ids, state->new_ids_capacity * sizeof(unsigned int));
+        assert_alloc(state->new_ids);
+    }
+    for (int region = 0; region < table->count; region++) {
+        state->new_ids[region] = add_region_id(state, &table->regions[region]);
+    }
+    for (int y = window[1]; y <= window[3]; y++) {
+        unsigned int* ids = threshold_image.region + bmp_index(threshold_image, window[0], y);
+        const unsigned int* labels = state->window_labels + (size_t)(y - window[1]) * window_width;
+        for (int x = 0; x < window_width; x++) {
+            if (labels[x] != NO_REGION) {
+                ids[x] = state->new_ids[labels[x] - 1];
+            }
+        }
+    }
+}
+
+int detect_next_frame(TemporalState* state, ThreadPool* pool, const ThresholdEngine* engine, Bmp frame) {
+    int whole_frame = state->previous.header == NULL ||
+                      state->previous.width != frame.width || state->previous.height != frame.height ||
+                      (state->full_interval > 0 && state->num_frames % state->full_interval == 0);
+    state->num_frames++;
+
+    if (whole_frame) {
+        detect_whole_frame(state, pool, engine, frame);
+    } else {
+        TileJob job = { .state = state, .engine = engine, .frame = frame };
+        run_parallel(pool, state->tiles_y, update_tile_row, &job);
+        mark_near_dirty(state);
+        if (state->num_dirty > 0) {
+            relabel_near_changes(state, pool);
+        }
+    }
+    list_detections(state);
+    return whole_frame;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+
+struct ThreadPool {
+    pthread_t* workers;         // num_threads - 1 workers (the caller is the last thread)
+    int num_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;   // Signalled when a new job is posted or the pool stops
+    pthread_cond_t job_done;    // Signalled when the last task of a job finishes
+
+    TaskFunction function;      // Current job
+    void* argument;
+    int num_tasks;
+    int next_task;              // Next task to hand out
+    int finished_tasks;
+    unsigned long generation;   // Incremented for every job so workers notice new ones
+    int stopping;
+};
+
+// Take tasks from the current job until none are left (lock held on entry and exit)
+static void work_on_job(ThreadPool* pool) {
+    while (pool->next_task < pool->num_tasks) {
+        int task = pool->next_task++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->function(pool->argument, task);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished_tasks == pool->num_tasks) {
+            pthread_cond_broadcast(&pool->job_done);
+        }
+    }
+}
+
+static void* worker_main(void* argument) {
+    ThreadPool* pool = argument;
+    unsigned long seen_generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stopping && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen_generation = pool->generation;
+        work_on_job(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool* create_thread_pool(int num_threads) {
+    ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        fprintf(stderr, "Could not allocate thread pool\n");
+        exit(1);
+    }
+    pool->num_threads = (num_threads > 0) ? num_threads : 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    pool->workers = malloc(pool->num_threads * sizeof(pthread_t));
+    if (pool->workers == NULL) {
+        fprintf(stderr, "Could not allocate thread pool\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool->num_threads - 1; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+int thread_pool_size(const ThreadPool* pool) {
+    return (pool != NULL) ? pool->num_threads : 1;
+}
+
+void run_parallel(ThreadPool* pool, int num_tasks, TaskFunction function, void* argument) {
+    if (pool == NULL || pool->num_threads == 1 || num_tasks <= 1) {
+        for (int task = 0; task < num_tasks; task++) {
+            function(argument, task);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->argument = argument;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->finished_tasks = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_ready);
+
+    // The caller works too, then waits for tasks still running elsewhere
+    work_on_job(pool);
+    while (pool->finished_tasks < pool->num_tasks) {
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void free_thread_pool(ThreadPool* pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads - 1; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->job_done);
+    free(pool->workers);
+    free(pool);
+}
+
+int default_thread_count(void) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return (processors > 0) ? (int)processors : 1;
+}
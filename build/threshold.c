@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "cam_detect.h"
+#include "threshold.h"
+
+#define SELF_CHECK_ROW_WIDTH 1000   // Row width for the all-colour check (not a multiple of 16 or 32)
+
+// Same test as the original per-calibration threshold loop, with each object's
+// own minimums: the first calibration wins
+unsigned short classify_pixel(const ThresholdEngine* engine, const unsigned char* pixel) {
+    HSV hsv_values = rgb2hsv((unsigned char*)pixel);
+    for (int calibration = 0; calibration < engine->num_calibrations; calibration++) {
+        const CalibratedObject* object = &engine->store->objects[calibration];
+        if ((hsv_values.saturation >= object->saturation_min) && (hsv_values.value >= object->value_min)
+            && object_covers_hue(object, hsv_values.hue)) {
+            return calibration;
+        }
+    }
+    return LUT_NONE;
+}
+
+// Same result as classify_pixel, but only tests the objects covering the pixel's hue
+unsigned short lookup_pixel(const ThresholdEngine* engine, const unsigned char* pixel) {
+    HSV hsv_values = rgb2hsv((unsigned char*)pixel);
+    int brightest = (pixel[RED] > pixel[GREEN]) ? pixel[RED] : pixel[GREEN];
+    brightest = (brightest > pixel[BLUE]) ? brightest : pixel[BLUE];
+    return match_calibration(engine->store, hsv_values.hue, hsv_values.saturation, brightest);
+}
+
+static void threshold_row_reference(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels) {
+    for (int x = 0; x < width; x++) {
+        store_label(classify_pixel(engine, pixels + x * BYTES_PER_PIXEL), x, object_type, mask_pixels);
+    }
+}
+
+static void threshold_row_scalar(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels) {
+    const uint16_t* labels = engine->lut.labels;
+    for (int x = 0; x < width; x++) {
+        store_label(labels[pack_rgb(pixels + x * BYTES_PER_PIXEL)], x, object_type, mask_pixels);
+    }
+}
+
+int threshold_kernel_supported(ThresholdKernelType kernel_type) {
+    __builtin_cpu_init();
+    switch (kernel_type) {
+        case KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case KERNEL_SSE41:
+            return __builtin_cpu_supports("sse4.1");
+        case KERNEL_AUTO:
+        case KERNEL_REFERENCE:
+        case KERNEL_SCALAR:
+            return 1;
+    }
+    return 0;
+}
+
+ThresholdKernelType detect_threshold_kernel(void) {
+    if (threshold_kernel_supported(KERNEL_AVX2)) {
+        return KERNEL_AVX2;
+    }
+    if (threshold_kernel_supported(KERNEL_SSE41)) {
+        return KERNEL_SSE41;
+    }
+    return KERNEL_SCALAR;
+}
+
+const char* threshold_kernel_name(ThresholdKernelType kernel_type) {
+    switch (kernel_type) {
+        case KERNEL_AUTO:
+            return "auto";
+        case KERNEL_REFERENCE:
+            return "reference";
+        case KERNEL_SCALAR:
+            return "scalar";
+        case KERNEL_SSE41:
+            return "sse4.1";
+        case KERNEL_AVX2:
+            return "avx2";
+    }
+    return "unknown";
+}
+
+ThresholdEngine create_threshold_engine(char* calibration_file_path, const CalibrationStore* store, ThresholdKernelType kernel_type) {
+    ThresholdEngine engine;
+    memset(&engine, 0, sizeof(engine));
+
+    if (kernel_type == KERNEL_AUTO) {
+        kernel_type = detect_threshold_kernel();
+    }
+    engine.kernel_type = kernel_type;
+
+    engine.store = store;
+    engine.num_calibrations = store->num_objects;
+
+    // Pixels darker or greyer than every object allows are rejected before
+    // computing their hue, so keep the loosest minimums of all objects
+    engine.min_saturation = MAX_PERCENT + 1;
+    engine.min_max_channel = 256;
+    for (int calibration = 0; calibration < store->num_objects; calibration++) {
+        const CalibratedObject* object = &store->objects[calibration];
+        if (object->saturation_min < engine.min_saturation) {
+            engine.min_saturation = object->saturation_min;
+        }
+        if (object->min_max_channel < engine.min_max_channel) {
+            engine.min_max_channel = object->min_max_channel;
+        }
+    }
+
+    // The SIMD kernels test the first object of each hue bucket in vector
+    // lanes, and only walk the rest of the bucket for lanes it does not match.
+    // Valid objects have saturation minimums up to MAX_PERCENT and brightest
+    // channel minimums up to 255, so both fit beside a 16-bit object
+    engine.hue_entries = malloc(HUE_RANGE * sizeof(uint32_t));
+    if (engine.hue_entries == NULL) {
+        fprintf(stderr, "Could not allocate threshold engine\n");
+        exit(1);
+    }
+    for (int hue = 0; hue < HUE_RANGE; hue++) {
+        uint32_t first = store->bucket_start[hue];
+        uint32_t entry = LUT_NONE;
+        if (first < store->bucket_start[hue + 1]) {
+            const CalibratedObject* object = &store->objects[store->bucket_objects[first]];
+            entry = store->bucket_objects[first] | ((uint32_t)object->saturation_min << HUE_ENTRY_SATURATION_SHIFT)
+                | ((uint32_t)object->min_max_channel << HUE_ENTRY_CHANNEL_SHIFT);
+            if (first + 1 < store->bucket_start[hue + 1]) {
+                entry |= HUE_ENTRY_MORE;
+            }
+        }
+        engine.hue_entries[hue] = entry;
+    }
+
+    switch (kernel_type) {
+        case KERNEL_AVX2:
+            engine.threshold_row = threshold_row_avx2;
+            break;
+        case KERNEL_SSE41:
+            engine.threshold_row = threshold_row_sse41;
+            break;
+        case KERNEL_SCALAR:
+            engine.lut = load_colour_lut(calibration_file_path, store);
+            engine.threshold_row = threshold_row_scalar;
+            break;
+        default:
+            engine.threshold_row = threshold_row_reference;
+            break;
+    }
+    return engine;
+}
+
+void free_threshold_engine(ThresholdEngine engine) {
+    if (engine.lut.labels != NULL) {
+        free_colour_lut(engine.lut);
+    }
+    free(engine.hue_entries);
+}
+
+// Everything the band tasks of one threshold_rows call share
+typedef struct {
+    const ThresholdEngine* engine;
+    Bmp image_bmp;
+    Bmp threshold_image;
+    int num_bands;
+} ThresholdJob;
+
+// Threshold one band of rows
+static void threshold_band(void* argument, int band) {
+    ThresholdJob* job = argument;
+    Bmp threshold_image = job->threshold_image;
+    int first_row = (int)((long)threshold_image.height * band / job->num_bands);
+    int end_row = (int)((long)threshold_image.height * (band + 1) / job->num_bands);
+    for (int y = first_row; y < end_row; y++) {
+        job->engine->threshold_row(job->engine, bmp_pixel(job->image_bmp, 0, y), threshold_image.width,
+                                   threshold_image.object_type + bmp_index(threshold_image, 0, y),
+                                   bmp_pixel(threshold_image, 0, y));
+    }
+}
+
+void threshold_rows(ThreadPool* pool, const ThresholdEngine* engine, Bmp image_bmp, Bmp threshold_image) {
+    int num_bands = thread_pool_size(pool);
+    if (num_bands > (int)threshold_image.height) {
+        num_bands = (int)threshold_image.height;
+    }
+    ThresholdJob job = { .engine = engine, .image_bmp = image_bmp, .threshold_image = threshold_image, .num_bands = num_bands };
+    run_parallel(pool, num_bands, threshold_band, &job);
+}
+
+// Compare a kernel against the reference on one row, returning the first differing x or -1
+static int compare_row(const ThresholdEngine* reference, const ThresholdEngine* engine, const unsigned char* pixels, int width, void* buffers) {
+    unsigned short* expected_type = buffers;
+    unsigned short* actual_type = expected_type + width;
+    unsigned char* expected_mask = (unsigned char*)(actual_type + width);
+    unsigned char* actual_mask = expected_mask + width * BYTES_PER_PIXEL;
+
+    reference->threshold_row(reference, pixels, width, expected_type, expected_mask);
+    engine->threshold_row(engine, pixels, width, actual_type, actual_mask);
+    for (int x = 0; x < width; x++) {
+        if (expected_type[x] != actual_type[x] || memcmp(expected_mask + x * BYTES_PER_PIXEL, actual_mask + x * BYTES_PER_PIXEL, BYTES_PER_PIXEL) != 0) {
+            return x;
+        }
+    }
+    return -1;
+}
+
+// Run every supported kernel over the images and every 24-bit colour
+int threshold_self_check(char* calibration_file_path, const CalibrationStore* store, char** image_paths, int num_images) {
+    ThresholdKernelType kernels[] = {KERNEL_SCALAR, KERNEL_SSE41, KERNEL_AVX2};
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    ThresholdEngine engines[sizeof(kernels) / sizeof(kernels[0])];
+    int supported[sizeof(kernels) / sizeof(kernels[0])];
+
+    ThresholdEngine reference = create_threshold_engine(calibration_file_path, store, KERNEL_REFERENCE);
+    printf("Self check against %s (CPU default: %s)\n", threshold_kernel_name(KERNEL_REFERENCE), threshold_kernel_name(detect_threshold_kernel()));
+    for (int k = 0; k < num_kernels; k++) {
+        supported[k] = threshold_kernel_supported(kernels[k]);
+        if (supported[k]) {
+            engines[k] = create_threshold_engine(calibration_file_path, store, kernels[k]);
+        } else {
+            printf("%s: not supported by this CPU, skipped\n", threshold_kernel_name(kernels[k]));
+        }
+    }
+
+    // Every 24-bit colour laid out in rows that leave a partial SIMD block at the end
+    unsigned char* colours = malloc((size_t)LUT_ENTRIES * BYTES_PER_PIXEL);
+    void* buffers = malloc((size_t)SELF_CHECK_ROW_WIDTH * 2 * (sizeof(unsigned short) + BYTES_PER_PIXEL));
+    if (colours == NULL || buffers == NULL) {
+        fprintf(stderr, "Could not allocate self check buffers\n");
+        exit(1);
+    }
+    for (uint32_t colour = 0; colour < LUT_ENTRIES; colour++) {
+        colours[colour * BYTES_PER_PIXEL + RED] = colour >> 16;
+        colours[colour * BYTES_PER_PIXEL + GREEN] = colour >> 8;
+        colours[colour * BYTES_PER_PIXEL + BLUE] = colour;
+    }
+
+    int failures = 0;
+    for (int k = 0; k < num_kernels; k++) {
+        if (!supported[k]) {
+            continue;
+        }
+        int mismatch = -1;
+        for (uint32_t start = 0; start < LUT_ENTRIES && mismatch < 0; start += SELF_CHECK_ROW_WIDTH) {
+            int width = (LUT_ENTRIES - start < SELF_CHECK_ROW_WIDTH) ? (int)(LUT_ENTRIES - start) : SELF_CHECK_ROW_WIDTH;
+            int x = compare_row(&reference, &engines[k], colours + (size_t)start * BYTES_PER_PIXEL, width, buffers);
+            if (x >= 0) {
+                mismatch = start + x;
+            }
+        }
+        if (mismatch >= 0) {
+            printf("all colours: %s MISMATCH at colour #%06x\n", threshold_kernel_name(kernels[k]), mismatch);
+            failures++;
+        } else {
+            printf("all colours: %s ok\n", threshold_kernel_name(kernels[k]));
+        }
+    }
+    free(colours);
+    free(buffers);
+
+    for (int i = 0; i < num_images; i++) {
+        Bmp image = read_bmp(image_paths[i]);
+        buffers = malloc((size_t)image.width * 2 * (sizeof(unsigned short) + BYTES_PER_PIXEL));
+        if (buffers == NULL) {
+            fprintf(stderr, "Could not allocate self check buffers\n");
+            exit(1);
+        }
+        for (int k = 0; k < num_kernels; k++) {
+            if (!supported[k]) {
+                continue;
+            }
+            int mismatch_x = -1, mismatch_y = -1;
+            for (unsigned int y = 0; y < image.height && mismatch_x < 0; y++) {
+                mismatch_x = compare_row(&reference, &engines[k], bmp_pixel(image, 0, y), image.width, buffers);
+                mismatch_y = y;
+            }
+            if (mismatch_x >= 0) {
+                printf("%s: %s MISMATCH at (%d, %d)\n", image_paths[i], threshold_kernel_name(kernels[k]), mismatch_x, mismatch_y);
+                failures++;
+            } else {
+                printf("%s: %s ok\n", image_paths[i], threshold_kernel_name(kernels[k]));
+            }
+        }
+        free(buffers);
+        free_bmp(image);
+    }
+
+    for (int k = 0; k < num_kernels; k++) {
+        if (supported[k]) {
+            free_threshold_engine(engines[k]);
+        }
+    }
+    free_threshold_engine(reference);
+    return failures;
+}
@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "bitmap.h"
+#include "threshold.h"
+
+// The kernels compute the brightest channel, darkest channel and their
+// difference with byte-wide integer maths, which is enough to reject dark and
+// grey pixels 16 or 32 at a time. Saturation and hue are then computed with the
+// exact double-precision steps rgb2hsv() uses, so every label matches the
+// scalar path bit for bit (self_check mode verifies this). Each lane is then
+// tested against the first object of its hue bucket with vector compares and
+// blends. That is only branch free while every bucket holds at most one object:
+// a lane failing its first object in a bucket that holds more drops out to
+// retry_lanes, which walks the rest of the bucket one lane at a time.
+
+#define CHANNEL_SCALE 255.0     // rgb2hsv divides each channel by this
+#define PERCENT_SCALE 100.0     // rgb2hsv scales saturation to 0-100
+#define DEGREES_PER_SECTOR 60.0 // rgb2hsv scales each hue sector to 60 degrees
+#define GREEN_SECTOR 2.0        // rgb2hsv offset for hues where green is brightest
+#define BLUE_SECTOR 4.0         // rgb2hsv offset for hues where blue is brightest
+#define FULL_CIRCLE 360         // Degrees in the hue circle
+
+// pshufb masks gathering one colour of 16 interleaved BGR pixels out of each of
+// the three 16-byte loads covering them: [colour offset][load]
+static const int8_t deinterleave_masks[BYTES_PER_PIXEL][3][16] __attribute__((aligned(16))) = {
+    {
+        {0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 1, 4, 7, 10, 13},
+    },
+    {
+        {1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14},
+    },
+    {
+        {2, 5, 8, 11, 14, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128},
+        {-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15},
+    },
+};
+
+// pshufb masks repeating each of 16 mask bytes three times (one per colour)
+static const int8_t interleave_masks[3][16] __attribute__((aligned(16))) = {
+    {0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5},
+    {5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10},
+    {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15},
+};
+
+// Pull one colour of 16 BGR pixels out of the 3 loads covering them
+__attribute__((target("sse4.1")))
+static inline __m128i deinterleave_colour(__m128i first, __m128i second, __m128i third, int colour) {
+    __m128i gathered = _mm_shuffle_epi8(first, _mm_load_si128((const __m128i*)deinterleave_masks[colour][0]));
+    gathered = _mm_or_si128(gathered, _mm_shuffle_epi8(second, _mm_load_si128((const __m128i*)deinterleave_masks[colour][1])));
+    return _mm_or_si128(gathered, _mm_shuffle_epi8(third, _mm_load_si128((const __m128i*)deinterleave_masks[colour][2])));
+}
+
+// Write 16 mask bytes as 16 white/black BGR pixels
+__attribute__((target("sse4.1")))
+static inline void store_mask_pixels(unsigned char* mask_pixels, __m128i mask) {
+    for (int part = 0; part < 3; part++) {
+        __m128i pixels = _mm_shuffle_epi8(mask, _mm_load_si128((const __m128i*)interleave_masks[part]));
+        _mm_storeu_si128((__m128i*)(mask_pixels + part * 16), pixels);
+    }
+}
+
+// Labels for the lanes whose first hue bucket object failed but whose bucket
+// holds more, found by a scalar walk of the bucket (overlapping hue ranges
+// make this branch per lane)
+static void retry_lanes(const ThresholdEngine* engine, int retry_bits, const int32_t* saturations, const int32_t* hues,
+                        const int32_t* brightests, int32_t* labels) {
+    for (int lane = 0; retry_bits != 0; lane++, retry_bits >>= 1) {
+        if (retry_bits & 1) {
+            labels[lane] = match_calibration(engine->store, hues[lane], saturations[lane], brightests[lane]);
+        }
+    }
+}
+
+// Label 4 pixels from their saturation, hue and brightest channel: test the
+// first object of each hue bucket in every lane, then fall back to the scalar
+// retry_lanes for lanes that fail it in a bucket holding more objects
+__attribute__((target("sse4.1")))
+static inline __m128i label_from_hsv_sse41(const ThresholdEngine* engine, __m128i saturation, __m128i hue, __m128i brightest) {
+    __m128i entries = _mm_set_epi32(engine->hue_entries[_mm_extract_epi32(hue, 3)], engine->hue_entries[_mm_extract_epi32(hue, 2)],
+                                    engine->hue_entries[_mm_extract_epi32(hue, 1)], engine->hue_entries[_mm_extract_epi32(hue, 0)]);
+    __m128i saturation_min = _mm_and_si128(_mm_srli_epi32(entries, HUE_ENTRY_SATURATION_SHIFT), _mm_set1_epi32(HUE_ENTRY_SATURATION_MASK));
+    __m128i channel_min = _mm_and_si128(_mm_srli_epi32(entries, HUE_ENTRY_CHANNEL_SHIFT), _mm_set1_epi32(HUE_ENTRY_CHANNEL_MASK));
+    __m128i passed = _mm_and_si128(_mm_cmpgt_epi32(saturation, _mm_sub_epi32(saturation_min, _mm_set1_epi32(1))),
+                                   _mm_cmpgt_epi32(brightest, _mm_sub_epi32(channel_min, _mm_set1_epi32(1))));
+    __m128i label = _mm_blendv_epi8(_mm_set1_epi32(LUT_NONE), _mm_and_si128(entries, _mm_set1_epi32(HUE_ENTRY_LABEL_MASK)), passed);
+
+    int retry_bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(passed, entries)));
+    if (retry_bits != 0) {
+        int32_t saturations[4] __attribute__((aligned(16)));
+        int32_t hues[4] __attribute__((aligned(16)));
+        int32_t brightests[4] __attribute__((aligned(16)));
+        int32_t labels[4] __attribute__((aligned(16)));
+        _mm_store_si128((__m128i*)saturations, saturation);
+        _mm_store_si128((__m128i*)hues, hue);
+        _mm_store_si128((__m128i*)brightests, brightest);
+        _mm_store_si128((__m128i*)labels, label);
+        retry_lanes(engine, retry_bits, saturations, hues, brightests, labels);
+        label = _mm_load_si128((const __m128i*)labels);
+    }
+    return label;
+}
+
+// rgb2hsv's saturation and hue for the 2 pixels in the low lanes, as doubles
+__attribute__((target("sse4.1")))
+static inline void hsv_pair_sse41(__m128i red, __m128i green, __m128i blue, __m128i brightest, __m128i darkest, __m128i* saturation, __m128i* hue) {
+    __m128d scale = _mm_set1_pd(CHANNEL_SCALE);
+    __m128d R = _mm_div_pd(_mm_cvtepi32_pd(red), scale);
+    __m128d G = _mm_div_pd(_mm_cvtepi32_pd(green), scale);
+    __m128d B = _mm_div_pd(_mm_cvtepi32_pd(blue), scale);
+    __m128d Cmax = _mm_div_pd(_mm_cvtepi32_pd(brightest), scale);
+    __m128d Cmin = _mm_div_pd(_mm_cvtepi32_pd(darkest), scale);
+    __m128d delta = _mm_sub_pd(Cmax, Cmin);
+
+    *saturation = _mm_cvttpd_epi32(_mm_div_pd(_mm_mul_pd(_mm_set1_pd(PERCENT_SCALE), delta), Cmax));
+
+    __m128d red_brightest = _mm_cmpge_pd(R, Cmax);
+    __m128d green_brightest = _mm_cmpge_pd(G, Cmax);
+    __m128d h = _mm_add_pd(_mm_set1_pd(BLUE_SECTOR), _mm_div_pd(_mm_sub_pd(R, G), delta));
+    h = _mm_blendv_pd(h, _mm_add_pd(_mm_set1_pd(GREEN_SECTOR), _mm_div_pd(_mm_sub_pd(B, R), delta)), green_brightest);
+    h = _mm_blendv_pd(h, _mm_div_pd(_mm_sub_pd(G, B), delta), red_brightest);
+    h = _mm_mul_pd(h, _mm_set1_pd(DEGREES_PER_SECTOR));
+    h = _mm_blendv_pd(h, _mm_add_pd(h, _mm_set1_pd(FULL_CIRCLE)), _mm_cmplt_pd(h, _mm_setzero_pd()));
+    *hue = _mm_cvttpd_epi32(h);
+}
+
+// Label 4 pixels whose colours are in the low 4 bytes of each vector
+__attribute__((target("sse4.1")))
+static inline __m128i label_quad_sse41(const ThresholdEngine* engine, __m128i red8, __m128i green8, __m128i blue8, __m128i brightest8, __m128i darkest8) {
+    __m128i red = _mm_cvtepu8_epi32(red8);
+    __m128i green = _mm_cvtepu8_epi32(green8);
+    __m128i blue = _mm_cvtepu8_epi32(blue8);
+    __m128i brightest = _mm_cvtepu8_epi32(brightest8);
+    __m128i darkest = _mm_cvtepu8_epi32(darkest8);
+
+    __m128i saturation_low, hue_low, saturation_high, hue_high;
+    hsv_pair_sse41(red, green, blue, brightest, darkest, &saturation_low, &hue_low);
+    hsv_pair_sse41(_mm_srli_si128(red, 8), _mm_srli_si128(green, 8), _mm_srli_si128(blue, 8),
+                   _mm_srli_si128(brightest, 8), _mm_srli_si128(darkest, 8), &saturation_high, &hue_high);
+    __m128i saturation = _mm_unpacklo_epi64(saturation_low, saturation_high);
+    __m128i hue = _mm_unpacklo_epi64(hue_low, hue_high);
+
+    // rgb2hsv returns zero saturation and hue for greys
+    __m128i grey = _mm_cmpeq_epi32(brightest, darkest);
+    saturation = _mm_andnot_si128(grey, saturation);
+    hue = _mm_andnot_si128(grey, hue);
+    return label_from_hsv_sse41(engine, saturation, hue, brightest);
+}
+
+// Label 16 pixels given their colours, one 16-bit label per pixel: the first 8 in low, the rest in high
+__attribute__((target("sse4.1")))
+static inline void label_block_sse41(const ThresholdEngine* engine, __m128i red, __m128i green, __m128i blue, __m128i* low, __m128i* high) {
+    __m128i brightest = _mm_max_epu8(_mm_max_epu8(red, green), blue);
+    __m128i darkest = _mm_min_epu8(_mm_min_epu8(red, green), blue);
+
+    // Only pixels bright enough (and not grey, unless any saturation passes) can match
+    __m128i candidates = _mm_setzero_si128();
+    if (engine->min_max_channel <= 255) {
+        __m128i min_max_channel = _mm_set1_epi8((char)engine->min_max_channel);
+        candidates = _mm_cmpeq_epi8(_mm_max_epu8(brightest, min_max_channel), brightest);
+        if (engine->min_saturation > 0) {
+            candidates = _mm_andnot_si128(_mm_cmpeq_epi8(brightest, darkest), candidates);
+        }
+    }
+    int candidate_bits = _mm_movemask_epi8(candidates);
+    __m128i none = _mm_set1_epi16((short)LUT_NONE);
+    if (candidate_bits == 0) {
+        *low = none;
+        *high = none;
+        return;
+    }
+
+    __m128i labels[4];
+    for (int quad = 0; quad < 4; quad++) {
+        if (((candidate_bits >> (quad * 4)) & 0xF) != 0) {
+            labels[quad] = label_quad_sse41(engine, red, green, blue, brightest, darkest);
+        } else {
+            labels[quad] = _mm_set1_epi32(LUT_NONE);
+        }
+        red = _mm_srli_si128(red, 4);
+        green = _mm_srli_si128(green, 4);
+        blue = _mm_srli_si128(blue, 4);
+        brightest = _mm_srli_si128(brightest, 4);
+        darkest = _mm_srli_si128(darkest, 4);
+    }
+    *low = _mm_blendv_epi8(none, _mm_packus_epi32(labels[0], labels[1]), _mm_cvtepi8_epi16(candidates));
+    *high = _mm_blendv_epi8(none, _mm_packus_epi32(labels[2], labels[3]), _mm_cvtepi8_epi16(_mm_srli_si128(candidates, 8)));
+}
+
+// Store 16 labels (8 in low, 8 in high) as object types (0 where unmatched) and mask pixels
+__attribute__((target("sse4.1")))
+static inline void store_block_sse41(__m128i low, __m128i high, unsigned short* object_type, unsigned char* mask_pixels) {
+    __m128i none = _mm_set1_epi16((short)LUT_NONE);
+    __m128i all = _mm_set1_epi16(-1);
+    __m128i matched_low = _mm_xor_si128(_mm_cmpeq_epi16(low, none), all);
+    __m128i matched_high = _mm_xor_si128(_mm_cmpeq_epi16(high, none), all);
+    _mm_storeu_si128((__m128i*)object_type, _mm_and_si128(low, matched_low));
+    _mm_storeu_si128((__m128i*)(object_type + SIMD_SSE41_PIXELS / 2), _mm_and_si128(high, matched_high));
+    store_mask_pixels(mask_pixels, _mm_packs_epi16(matched_low, matched_high));
+}
+
+// Finish the pixels that do not fill a whole block
+static void threshold_tail(const ThresholdEngine* engine, const unsigned char* pixels, int x, int width, unsigned short* object_type, unsigned char* mask_pixels) {
+    for (; x < width; x++) {
+        store_label(lookup_pixel(engine, pixels + x * BYTES_PER_PIXEL), x, object_type, mask_pixels);
+    }
+}
+
+__attribute__((target("sse4.1")))
+void threshold_row_sse41(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels) {
+    int x = 0;
+    for (; x + SIMD_SSE41_PIXELS <= width; x += SIMD_SSE41_PIXELS) {
+        const unsigned char* block = pixels + x * BYTES_PER_PIXEL;
+        __m128i first = _mm_loadu_si128((const __m128i*)block);
+        __m128i second = _mm_loadu_si128((const __m128i*)(block + 16));
+        __m128i third = _mm_loadu_si128((const __m128i*)(block + 32));
+
+        __m128i low, high;
+        label_block_sse41(engine,
+                          deinterleave_colour(first, second, third, RED),
+                          deinterleave_colour(first, second, third, GREEN),
+                          deinterleave_colour(first, second, third, BLUE), &low, &high);
+        store_block_sse41(low, high, object_type + x, mask_pixels + x * BYTES_PER_PIXEL);
+    }
+    threshold_tail(engine, pixels, x, width, object_type, mask_pixels);
+}
+
+// Label 8 pixels from their saturation, hue and brightest channel (see label_from_hsv_sse41)
+__attribute__((target("avx2")))
+static inline __m256i label_from_hsv_avx2(const ThresholdEngine* engine, __m256i saturation, __m256i hue, __m256i brightest) {
+    __m256i entries = _mm256_i32gather_epi32((const int*)engine->hue_entries, hue, sizeof(uint32_t));
+    __m256i saturation_min = _mm256_and_si256(_mm256_srli_epi32(entries, HUE_ENTRY_SATURATION_SHIFT), _mm256_set1_epi32(HUE_ENTRY_SATURATION_MASK));
+    __m256i channel_min = _mm256_and_si256(_mm256_srli_epi32(entries, HUE_ENTRY_CHANNEL_SHIFT), _mm256_set1_epi32(HUE_ENTRY_CHANNEL_MASK));
+    __m256i passed = _mm256_and_si256(_mm256_cmpgt_epi32(saturation, _mm256_sub_epi32(saturation_min, _mm256_set1_epi32(1))),
+                                      _mm256_cmpgt_epi32(brightest, _mm256_sub_epi32(channel_min, _mm256_set1_epi32(1))));
+    __m256i label = _mm256_blendv_epi8(_mm256_set1_epi32(LUT_NONE), _mm256_and_si256(entries, _mm256_set1_epi32(HUE_ENTRY_LABEL_MASK)), passed);
+
+    int retry_bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(passed, entries)));
+    if (retry_bits != 0) {
+        int32_t saturations[8] __attribute__((aligned(32)));
+        int32_t hues[8] __attribute__((aligned(32)));
+        int32_t brightests[8] __attribute__((aligned(32)));
+        int32_t labels[8] __attribute__((aligned(32)));
+        _mm256_store_si256((__m256i*)saturations, saturation);
+        _mm256_store_si256((__m256i*)hues, hue);
+        _mm256_store_si256((__m256i*)brightests, brightest);
+        _mm256_store_si256((__m256i*)labels, label);
+        retry_lanes(engine, retry_bits, saturations, hues, brightests, labels);
+        label = _mm256_load_si256((const __m256i*)labels);
+    }
+    return label;
+}
+
+// rgb2hsv's saturation and hue for 4 pixels, as doubles (see hsv_pair_sse41)
+__attribute__((target("avx2")))
+static inline void hsv_quad_avx2(__m128i red, __m128i green, __m128i blue, __m128i brightest, __m128i darkest, __m128i* saturation, __m128i* hue) {
+    __m256d scale = _mm256_set1_pd(CHANNEL_SCALE);
+    __m256d R = _mm256_div_pd(_mm256_cvtepi32_pd(red), scale);
+    __m256d G = _mm256_div_pd(_mm256_cvtepi32_pd(green), scale);
+    __m256d B = _mm256_div_pd(_mm256_cvtepi32_pd(blue), scale);
+    __m256d Cmax = _mm256_div_pd(_mm256_cvtepi32_pd(brightest), scale);
+    __m256d Cmin = _mm256_div_pd(_mm256_cvtepi32_pd(darkest), scale);
+    __m256d delta = _mm256_sub_pd(Cmax, Cmin);
+
+    *saturation = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_mul_pd(_mm256_set1_pd(PERCENT_SCALE), delta), Cmax));
+
+    __m256d red_brightest = _mm256_cmp_pd(R, Cmax, _CMP_GE_OQ);
+    __m256d green_brightest = _mm256_cmp_pd(G, Cmax, _CMP_GE_OQ);
+    __m256d h = _mm256_add_pd(_mm256_set1_pd(BLUE_SECTOR), _mm256_div_pd(_mm256_sub_pd(R, G), delta));
+    h = _mm256_blendv_pd(h, _mm256_add_pd(_mm256_set1_pd(GREEN_SECTOR), _mm256_div_pd(_mm256_sub_pd(B, R), delta)), green_brightest);
+    h = _mm256_blendv_pd(h, _mm256_div_pd(_mm256_sub_pd(G, B), delta), red_brightest);
+    h = _mm256_mul_pd(h, _mm256_set1_pd(DEGREES_PER_SECTOR));
+    h = _mm256_blendv_pd(h, _mm256_add_pd(h, _mm256_set1_pd(FULL_CIRCLE)), _mm256_cmp_pd(h, _mm256_setzero_pd(), _CMP_LT_OQ));
+    *hue = _mm256_cvttpd_epi32(h);
+}
+
+// Label 8 pixels whose colours are in the low 8 bytes of each vector
+__attribute__((target("avx2")))
+static inline __m256i label_octet_avx2(const ThresholdEngine* engine, __m128i red8, __m128i green8, __m128i blue8, __m128i brightest8, __m128i darkest8) {
+    __m256i red = _mm256_cvtepu8_epi32(red8);
+    __m256i green = _mm256_cvtepu8_epi32(green8);
+    __m256i blue = _mm256_cvtepu8_epi32(blue8);
+    __m256i brightest = _mm256_cvtepu8_epi32(brightest8);
+    __m256i darkest = _mm256_cvtepu8_epi32(darkest8);
+
+    __m128i saturation_low, hue_low, saturation_high, hue_high;
+    hsv_quad_avx2(_mm256_castsi256_si128(red), _mm256_castsi256_si128(green), _mm256_castsi256_si128(blue),
+                  _mm256_castsi256_si128(brightest), _mm256_castsi256_si128(darkest), &saturation_low, &hue_low);
+    hsv_quad_avx2(_mm256_extracti128_si256(red, 1), _mm256_extracti128_si256(green, 1), _mm256_extracti128_si256(blue, 1),
+                  _mm256_extracti128_si256(brightest, 1), _mm256_extracti128_si256(darkest, 1), &saturation_high, &hue_high);
+    __m256i saturation = _mm256_inserti128_si256(_mm256_castsi128_si256(saturation_low), saturation_high, 1);
+    __m256i hue = _mm256_inserti128_si256(_mm256_castsi128_si256(hue_low), hue_high, 1);
+
+    // rgb2hsv returns zero saturation and hue for greys
+    __m256i grey = _mm256_cmpeq_epi32(brightest, darkest);
+    saturation = _mm256_andnot_si256(grey, saturation);
+    hue = _mm256_andnot_si256(grey, hue);
+    return label_from_hsv_avx2(engine, saturation, hue, brightest);
+}
+
+// Pack 8 labels held as 32-bit lanes into 8 16-bit lanes
+__attribute__((target("avx2")))
+static inline __m128i pack_octet_avx2(__m256i labels) {
+    return _mm_packus_epi32(_mm256_castsi256_si128(labels), _mm256_extracti128_si256(labels, 1));
+}
+
+__attribute__((target("avx2")))
+void threshold_row_avx2(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels) {
+    __m256i min_max_channel = _mm256_set1_epi8((char)engine->min_max_channel);
+    __m128i none = _mm_set1_epi16((short)LUT_NONE);
+    int x = 0;
+    for (; x + SIMD_AVX2_PIXELS <= width; x += SIMD_AVX2_PIXELS) {
+        const unsigned char* block = pixels + x * BYTES_PER_PIXEL;
+
+        // Deinterleave each half of 16 pixels, then work on all 32 together
+        __m128i colours[BYTES_PER_PIXEL][2];
+        for (int half = 0; half < 2; half++) {
+            const unsigned char* half_block = block + half * SIMD_SSE41_PIXELS * BYTES_PER_PIXEL;
+            __m128i first = _mm_loadu_si128((const __m128i*)half_block);
+            __m128i second = _mm_loadu_si128((const __m128i*)(half_block + 16));
+            __m128i third = _mm_loadu_si128((const __m128i*)(half_block + 32));
+            for (int colour = 0; colour < BYTES_PER_PIXEL; colour++) {
+                colours[colour][half] = deinterleave_colour(first, second, third, colour);
+            }
+        }
+        __m256i red = _mm256_set_m128i(colours[RED][1], colours[RED][0]);
+        __m256i green = _mm256_set_m128i(colours[GREEN][1], colours[GREEN][0]);
+        __m256i blue = _mm256_set_m128i(colours[BLUE][1], colours[BLUE][0]);
+        __m256i brightest = _mm256_max_epu8(_mm256_max_epu8(red, green), blue);
+        __m256i darkest = _mm256_min_epu8(_mm256_min_epu8(red, green), blue);
+
+        // Only pixels bright enough (and not grey, unless any saturation passes) can match
+        __m256i candidates = _mm256_setzero_si256();
+        if (engine->min_max_channel <= 255) {
+            candidates = _mm256_cmpeq_epi8(_mm256_max_epu8(brightest, min_max_channel), brightest);
+            if (engine->min_saturation > 0) {
+                candidates = _mm256_andnot_si256(_mm256_cmpeq_epi8(brightest, darkest), candidates);
+            }
+        }
+        uint32_t candidate_bits = (uint32_t)_mm256_movemask_epi8(candidates);
+
+        // 16-bit labels of each 8 pixels
+        __m128i octets[4];
+        for (int octet = 0; octet < 4; octet++) {
+            if (((candidate_bits >> (octet * 8)) & 0xFF) == 0) {
+                octets[octet] = none;
+                continue;
+            }
+            int half = octet / 2;
+            int shift = (octet % 2) * 8;
+            __m128i red8 = half ? _mm256_extracti128_si256(red, 1) : _mm256_castsi256_si128(red);
+            __m128i green8 = half ? _mm256_extracti128_si256(green, 1) : _mm256_castsi256_si128(green);
+            __m128i blue8 = half ? _mm256_extracti128_si256(blue, 1) : _mm256_castsi256_si128(blue);
+            __m128i brightest8 = half ? _mm256_extracti128_si256(brightest, 1) : _mm256_castsi256_si128(brightest);
+            __m128i darkest8 = half ? _mm256_extracti128_si256(darkest, 1) : _mm256_castsi256_si128(darkest);
+            __m128i candidates8 = half ? _mm256_extracti128_si256(candidates, 1) : _mm256_castsi256_si128(candidates);
+            if (shift) {
+                red8 = _mm_srli_si128(red8, 8);
+                green8 = _mm_srli_si128(green8, 8);
+                blue8 = _mm_srli_si128(blue8, 8);
+                brightest8 = _mm_srli_si128(brightest8, 8);
+                darkest8 = _mm_srli_si128(darkest8, 8);
+                candidates8 = _mm_srli_si128(candidates8, 8);
+            }
+            __m128i labels = pack_octet_avx2(label_octet_avx2(engine, red8, green8, blue8, brightest8, darkest8));
+            octets[octet] = _mm_blendv_epi8(none, labels, _mm_cvtepi8_epi16(candidates8));
+        }
+
+        store_block_sse41(octets[0], octets[1], object_type + x, mask_pixels + x * BYTES_PER_PIXEL);
+        store_block_sse41(octets[2], octets[3], object_type + x + SIMD_SSE41_PIXELS,
+                          mask_pixels + (x + SIMD_SSE41_PIXELS) * BYTES_PER_PIXEL);
+    }
+    threshold_tail(engine, pixels, x, width, object_type, mask_pixels);
+}
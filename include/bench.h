@@ -0,0 +1,23 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#define DEFAULT_BENCH_ITERATIONS 20     ///< Times each image is detected when no count is given
+#define BENCH_DIRECTORY_TEMPLATE "/tmp/cam_detect_bench.XXXXXX" ///< Scratch directory for synthetic frames and outputs
+#define SYNTHETIC_PIXELS_PER_BLOB 40000 ///< Synthetic frames get one coloured disc per this many pixels
+#define SYNTHETIC_SEED 12345u           ///< Seed of the synthetic frame generator (frames are the same every run)
+
+/**
+ @brief Times every stage of detection over the images in DEFAULT_IMAGE_DIRECTORY and synthetic
+ frames from 640x480 up to 3840x2160, printing the results as JSON
+ 
+ For each image the read, threshold, label, classify and write stages are
+ timed separately over every iteration (after one warm-up run), and their
+ latency percentiles, throughput and allocations per frame are reported,
+ followed by the peak resident set size of the whole run.
+ @param calibration_file_path Path to the calibration file
+ @param num_threads Number of threads to threshold and label with
+ @param iterations Number of timed runs per image
+ */
+void bench_mode(char* calibration_file_path, int num_threads, int iterations);
+
+#endif
@@ -1,9 +1,17 @@
 #ifndef _BITMAP_H
 #define _BITMAP_H
 
-#define RED 0
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Byte offsets of each colour inside a pixel
+// pixels are kept in the same [BLUE, GREEN, RED] order as the file
+#define BLUE 0
 #define GREEN 1
-#define BLUE 2
+#define RED 2
+
+#define BYTES_PER_PIXEL 3       // Number of colour bytes in each pixel
 
 
 
@@ -17,10 +25,21 @@ typedef struct {
     // The width of the image in pixels
     unsigned int width; 
 
-    // 2D array of pointers to pixels
-    // pixels are a 3 byte arrays of [RED, GREEN, BLUE]
+    // Number of bytes between the start of one row and the next
+    // (rows are padded to a multiple of 4 bytes, just like in the file)
+    unsigned int stride;
+
+    // One contiguous buffer holding every row of the image
+    // each pixel is 3 bytes indexed with RED, GREEN and BLUE
     // each is a colour (from 0-255) is that component of colour in the pixel
-    unsigned char ***pixels;
+    // use bmp_pixel() to find the pixel at (x, y)
+    unsigned char *pixels;
+
+    // Side planes of per-pixel scratch values, one value per pixel
+    // (width * height values each), indexed with bmp_index()
+    // only threshold images have them (see add_planes), others leave them NULL
+    unsigned int *region;       // Region label the pixel belongs to (0 for none)
+    unsigned short *object_type; // Calibration number the pixel matched
 
     // Don't worry about this, we just use it to store some extra information about the image
     void *header;
@@ -51,15 +70,48 @@ typedef struct {
 extern RGB white;    // Declaration of white
 extern RGB black;    // Declaration of black
 
+// Returns a pointer to the 3 colour bytes of the pixel at (x, y)
+static inline unsigned char *bmp_pixel(Bmp image, int x, int y) {
+    return image.pixels + (size_t)y * image.stride + (size_t)x * BYTES_PER_PIXEL;
+}
+
+// Returns the index of the pixel at (x, y) inside the side planes
+static inline size_t bmp_index(Bmp image, int x, int y) {
+    return (size_t)y * image.width + x;
+}
+
 // Open an image
+// the file is memory-mapped and the pixels point straight into it
 Bmp read_bmp(char *filename); 
 
-// Write an image to a file
+// Open an image with every page of the file already faulted in
+// so the reading happens now rather than when the pixels are first used
+Bmp read_bmp_populated(char *filename);
+
+// Read the next image from a stream of concatenated files (such as stdin)
+// returns false once the stream ends cleanly between two files
+bool read_bmp_stream(FILE *stream, Bmp *bmp);
+
+// Write an image to a file with a single vectored write
 void write_bmp(Bmp, char *filename);
 
 // Copy an image
+// only the pixels are copied, the copy has no side planes
 Bmp copy_bmp(Bmp bmp);
 
+// Create a black 24-bit image of the given size
+Bmp create_bmp(unsigned int width, unsigned int height);
+
+// Give an image zeroed side planes, keeping any it already has
+// call this on threshold images before thresholding or labelling them
+Bmp add_planes(Bmp bmp);
+
+// Reuse target (a copy of an earlier image, or an empty Bmp) as a copy of source
+// its buffers and side planes are kept when the size matches and only the header
+// is copied (the pixels are left for the caller to overwrite); otherwise it is
+// freed and replaced by copy_bmp(source), which has no side planes
+Bmp reuse_bmp(Bmp source, Bmp target);
+
 // Free an image
 // Make sure this is called once for every Bmp you create
 void free_bmp(Bmp);
@@ -0,0 +1,150 @@
+#ifndef _CALIBRATION_STORE_H
+#define _CALIBRATION_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "colour_lut.h"
+
+#define STORE_MAGIC "CAMCAL02"      ///< Identifies a compiled calibration store file and its version (8 bytes)
+#define STORE_MAGIC_LENGTH 8        ///< Length of STORE_MAGIC without the terminator
+#define STORE_MAGIC_PREFIX_LENGTH 6 ///< Length of the part of STORE_MAGIC shared by every version ("CAMCAL")
+#define MAX_OBJECTS LUT_NONE        ///< Most objects a store holds (every object type except LUT_NONE fits 16 bits)
+#define INITIAL_OBJECTS 16          ///< Starting capacity of a growable array of objects
+#define MAX_HUE_RANGES 4            ///< Most hue ranges one object can have
+#define OBJECT_NAME_LENGTH 64       ///< Size of the name field of an object, terminator included
+#define MAX_PERCENT 100             ///< Largest saturation and value rgb2hsv returns
+
+// One hue window of a calibrated object
+typedef struct {
+    int32_t hue_mid;        ///< Middle hue of the window (0-360)
+    int32_t max_hue_diff;   ///< Largest hue difference from hue_mid that is inside the window
+} HueRange;
+
+// A calibrated object, laid out the same in memory and in a compiled store file
+typedef struct {
+    char name[OBJECT_NAME_LENGTH];      ///< Name printed for its detections
+    int32_t saturation_min;             ///< Minimum saturation of a matching pixel
+    int32_t value_min;                  ///< Minimum value of a matching pixel
+    int32_t min_max_channel;            ///< Smallest brightest channel (0-256) that passes value_min
+    int32_t num_ranges;                 ///< Number of hue ranges used
+    HueRange ranges[MAX_HUE_RANGES];    ///< Hue windows, any of which matches
+} CalibratedObject;
+
+// Calibrated objects plus an index of the objects whose hue ranges cover each
+// hue. The objects and index live in one buffer with the same layout as a
+// compiled store file, so a file is used straight from its mapping.
+struct CalibrationStore {
+    const CalibratedObject* objects;    ///< Objects in file order (the first match wins)
+    int num_objects;                    ///< Number of objects
+    const uint32_t* bucket_start;       ///< HUE_RANGE + 1 offsets into bucket_objects, one per hue
+    const uint16_t* bucket_objects;     ///< Objects covering each hue, in file order
+    void* buffer;                       ///< Allocated buffer holding everything (NULL if mapped)
+    void* mapping;                      ///< Store file mapping holding everything (NULL if allocated)
+    size_t size;                        ///< Size of the buffer or mapping
+};
+
+/**
+ @brief Returns the object a pixel matches, checking only the objects whose hue ranges cover its hue
+ @param store The calibration store
+ @param hue Hue of the pixel (0-360)
+ @param saturation Saturation of the pixel (0-100)
+ @param brightest Brightest colour channel of the pixel (0-255)
+ @return The first matching object, or LUT_NONE
+ */
+static inline unsigned short match_calibration(const CalibrationStore* store, int hue, int saturation, int brightest) {
+    for (uint32_t i = store->bucket_start[hue]; i < store->bucket_start[hue + 1]; i++) {
+        const CalibratedObject* object = &store->objects[store->bucket_objects[i]];
+        if (saturation >= object->saturation_min && brightest >= object->min_max_channel) {
+            return store->bucket_objects[i];
+        }
+    }
+    return LUT_NONE;
+}
+
+/**
+ @brief Returns whether any hue range of an object covers a hue
+ @param object The object
+ @param hue The hue (0-360)
+ @return 1 if covered, 0 otherwise
+ */
+int object_covers_hue(const CalibratedObject* object, int hue);
+
+/**
+ @brief Reads one line of the text format: name hue_mid max_hue_diff saturation value [hue_mid max_hue_diff ...]
+ @param line The line (tokenised in place)
+ @param object Receives the object
+ @return 1 if the line holds a valid object, 0 otherwise
+ */
+int parse_calibration_line(char* line, CalibratedObject* object);
+
+/**
+ @brief Adds a hue range to an object
+ @param object The object
+ @param hue_mid Middle hue of the range
+ @param max_hue_diff Largest hue difference inside the range
+ @return 1 on success, 0 if the object already has MAX_HUE_RANGES ranges
+ */
+int add_hue_range(CalibratedObject* object, int hue_mid, int max_hue_diff);
+
+/**
+ @brief Makes room for one more object in a growable array of objects, exiting if it cannot grow
+ @param objects The array (NULL when empty)
+ @param num_objects Number of objects in the array
+ @param capacity Number of objects allocated (updated when the array grows)
+ @return The array, which may have moved
+ */
+CalibratedObject* reserve_object(CalibratedObject* objects, int num_objects, int* capacity);
+
+/**
+ @brief Builds a store, with its hue-bucket index, from an array of objects
+ @param objects The objects (min_max_channel is filled in from value_min)
+ @param num_objects Number of objects (at most MAX_OBJECTS)
+ @return The store
+ */
+CalibrationStore compile_calibration_store(const CalibratedObject* objects, int num_objects);
+
+/**
+ @brief Loads a calibration store, mapping a compiled store file or compiling a text calibration file
+ @param calibration_file_path Path to the compiled store or text calibration file
+ @return The store
+ */
+CalibrationStore load_calibration_store(char* calibration_file_path);
+
+/**
+ @brief Returns whether a file is a compiled calibration store
+ @param calibration_file_path Path to the file
+ @return 1 if it starts with the STORE_MAGIC of any version, 0 otherwise (including when it cannot be read)
+ */
+int is_compiled_store(char* calibration_file_path);
+
+/**
+ @brief Writes a store as a compiled store file (replaced in one rename)
+ @param store The store
+ @param store_path Path to write to
+ @return 1 on success, 0 otherwise
+ */
+int save_calibration_store(const CalibrationStore* store, char* store_path);
+
+/**
+ @brief Writes a store in the text format, one object per line (replaced in one rename)
+ @param store The store
+ @param text_path Path to write to
+ @return 1 on success, 0 otherwise
+ */
+int save_calibration_text(const CalibrationStore* store, char* text_path);
+
+/**
+ @brief Prints an object in the text format, without a newline
+ @param file_pointer Where to print
+ @param object The object
+ */
+void print_calibration_line(FILE* file_pointer, const CalibratedObject* object);
+
+/**
+ @brief Frees (or unmaps) a store
+ @param store The store to free
+ */
+void free_calibration_store(CalibrationStore store);
+
+#endif
@@ -2,6 +2,13 @@
 #define _CAM_DETECT_H
 
 #include "bitmap.h"
+#include "colour_lut.h"
+#include "calibration_store.h"
+#include "threshold.h"
+#include "regions.h"
+#include "thread_pool.h"
+#include "profile.h"
+#include "bench.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +16,14 @@
 // Mode selection defines
 #define SHOW_CALIBRATION 's'    ///< Mode for displaying the calibration file contents
 #define DETECT 'd'              ///< Mode for detecting objects in the image using the calibration file
-#define CALIBRATE 'c'           ///< Mode for calibrating an object based on the image and label
+#define CALIBRATE 'c'           ///< Mode for calibrating objects based on images and labels
+#define COMPILE 'C'             ///< Mode for compiling a calibration file into a calibration store
+#define COMPILE_MODE_NAME "compile" ///< Mode argument selecting COMPILE (its first letter is taken by CALIBRATE)
+#define SELF_CHECK 'v'          ///< Mode for verifying the SIMD threshold kernels against rgb2hsv
+#define BATCH 'b'               ///< Mode for detecting objects in a sequence of images
+#define TEMPORAL 't'            ///< Mode for detecting objects in a sequence of images, redoing only what changed
+#define BENCH 'B'               ///< Mode for timing every stage of detection
+#define BENCH_MODE_NAME "bench" ///< Mode argument selecting BENCH (its first letter is taken by BATCH)
 
 // Argument index defines
 #define MODE 1                  ///< Index of the mode argument in argv
@@ -23,41 +37,47 @@
 #define MIN_ARGC 2              ///< Minimum number of arguments required to run the program
 #define ARGC_SHOW_CALIBRATION 3 ///< Required number of arguments for "show calibration" mode
 #define ARGC_DETECT 4           ///< Required number of arguments for "detect" mode
-#define ARGC_CALIBRATION 4      ///< Required number of arguments for "calibration" mode
+#define ARGC_CALIBRATION 4      ///< Minimum number of arguments for "calibration" mode
+#define ARGC_COMPILE 4          ///< Required number of arguments for "compile" mode
+#define MIN_ARGC_SELF_CHECK 3   ///< Minimum number of arguments for "self check" mode
+#define ARGC_BENCH 3            ///< Number of arguments for "bench" mode before its options
+#define ARGC_SEQUENCE 4         ///< Number of arguments for "batch" and "temporal" mode before their options
 
 // Buffer and data size defines
 #define STR_BUFFER_SIZE 1024    ///< Buffer size for strings
 #define INT_BUFFER_SIZE 10      ///< Buffer size for integers
-#define LEN_CALIBRATION_DATA 20 ///< Number of data points for each calibration file entry
 
 // Calibration and pixel index defines
 #define WINDOW_SIZE 50          ///< Size of the calibration window (width and height)
 #define ZERO_INDEX_ADJUSTMENT 1 ///< Adjustment for zero-indexed coordinates
 
-#define SATURATION_THRESHOLD 50 ///< Minimum saturation threshold for calibration
-#define VALUE_THRESHOLD 30      ///< Minimum value threshold for calibration
+#define SATURATION_THRESHOLD 50 ///< Minimum saturation of the pixels calibrated on, and of newly calibrated objects
+#define VALUE_THRESHOLD 30      ///< Minimum value of the pixels calibrated on, and of newly calibrated objects
 
-#define PIXEL_REGION_INDEX 3    ///< 4th index in each pixel to store region value
-#define VISITED_INDEX 4         ///< 5th index in each pixel to mark if visited for BFS
-#define OBJECT_TYPE_INDEX 5     ///< 6th index in each pixel to store object type
-#define MAX_CALIBRATIONS 10     ///< Maximum number of calibration entries allowed
-#define NAME_INDEX 0            ///< Index for name in calibration data
-#define HUE_MID_INDEX 1         ///< Index for middle hue value in calibration data
-#define MAX_HUE_INDEX 2         ///< Index for maximum hue in calibration data
+#define MIN_BOX_SIZE 20         ///< Minimum width and height of a reported region
 
-#define MAX_REGIONS 50          ///< Maximum number of regions
-
-#define NOT_VISITED 0           ///< Pixel status: not visited in BFS
-#define VISITED 1               ///< Pixel status: visited in BFS
 #define MAX_NAME_LENGTH 50      ///< Maximum length for object names
+#define INITIAL_PATHS 64        ///< Starting capacity of a list of image paths (it grows as needed)
+#define DEFAULT_IMAGE_DIRECTORY "images" ///< Images checked by self check mode when none are given
+
+#define THREADS_OPTION "-j"     ///< Option giving the number of threads to detect with
+#define MAX_THREADS 256         ///< Maximum number of threads allowed
+#define TIMING_OPTION "-t"      ///< Option making detect mode print the time of each stage
+#define ITERATIONS_OPTION "-n"  ///< Option giving the number of timed runs per image in bench mode
+#define OUTPUT_OPTION "-o"      ///< Option giving the directory sequence modes save boxed frames to
+#define FULL_INTERVAL_OPTION "-f"   ///< Option making temporal mode recompute whole frames every N frames
+#define APPEND_OPTION "-a"      ///< Option giving the calibration store calibration mode appends to
+#define STDIN_SOURCE "-"        ///< Batch source reading concatenated images from stdin
+#define FRAME_QUEUE_SIZE 4      ///< Frames read ahead of the one being detected in the sequence modes
+#define FRAME_FILE_FORMAT "frame_%06d.bmp" ///< Name of each boxed frame saved by the sequence modes
+#define INITIAL_DETECTIONS 64   ///< Starting capacity of a detection list (it grows as needed)
 
-// Region structure to define the bounding box of detected objects
+// Regions of one frame that are reported, in the order they are printed
 typedef struct {
-    int min_x; ///< Minimum x-coordinate of the region
-    int max_x; ///< Maximum x-coordinate of the region
-    int min_y; ///< Minimum y-coordinate of the region
-    int max_y; ///< Maximum y-coordinate of the region
-} Region;
+    const Region** regions;     ///< Reported regions (pointing into the region table they came from)
+    int count;                  ///< Number of reported regions
+    int capacity;               ///< Number of regions allocated
+} DetectionList;
 
 //--------------------------------------------------------------------------------------
 // Function declarations
@@ -76,16 +96,8 @@ void error_exit(int error_type);
 void clean_line(char* line);
 
 /**
- @brief Loads calibration data from a file into a data array
- @param calibration_file_path Path to the calibration file
- @param data Array to store calibration data
- @param num_calibrations Pointer to the number of calibrations loaded
- */
-void load_calibration_data(char* calibration_file_path, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int* num_calibrations);
-
-/**
- @brief Displays the contents of the calibration file for verification
- @param calibration_file_path Path to the calibration file
+ @brief Displays the objects of a calibration file or compiled store for verification
+ @param calibration_file_path Path to the calibration file or compiled store
  */
 void display_calibration_file(char* calibration_file_path);
 
@@ -106,66 +118,203 @@ void set_pixel_black(Bmp image, int x, int y);
 void set_pixel_white(Bmp image, int x, int y);
 
 /**
- @brief Applies thresholding to the image using calibration data
+ @brief Creates a thresholded version of an image and labels its regions, splitting the rows across threads
  @param image_bmp The original image bitmap
- @param data Array storing calibration data
- @param num_calibrations The number of calibrations loaded
- @return A thresholded Bmp image
+ @param engine Threshold engine built from the calibration data
+ @param pool Threads to use (NULL for the calling thread only)
+ @param regions Receives the regions found, each classified by its dominant object type
+ @return A thresholded Bmp image whose object_type plane labels each matched pixel
  */
-Bmp apply_threshold_to_image(Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations);
+Bmp create_threshold_image(Bmp image_bmp, const ThresholdEngine* engine, ThreadPool* pool, RegionTable* regions);
 
 /**
- @brief Loads calibration data and creates a thresholded version of an image
- @param calibration_file_path Path to the calibration file
- @param image_bmp The original image bitmap
- @param data Array storing calibration data
- @param num_calibrations Pointer to the number of calibrations loaded
- @return A thresholded Bmp image
+ @brief Returns whether a region is big enough to be reported (at least MIN_BOX_SIZE wide and high)
+ @param region The region
+ @return 1 if it is reported, 0 otherwise
  */
-Bmp create_threshold_image(char* calibration_file_path, Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int* num_calibrations);
+int is_detection(const Region* region);
 
 /**
- @brief Prints and saves an image with boxes around detected regions
- @param image_with_regions The image on which boxes will be drawn
- @param threshold_image The threshold image used for detection
- @param data Array storing calibration data
- @param num_calibrations Number of calibrations loaded
- @param region_array Array of detected regions
- @param region_number Number of detected regions
+ @brief Creates an empty detection list
+ @return The detection list
  */
-void print_image_with_boxes(Bmp image_with_regions, Bmp threshold_image, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations, Region region_array[], int region_number);
+DetectionList create_detection_list(void);
 
 /**
- @brief Performs a recursive depth-first search on a pixel to find connected regions
- @param threshold_image The threshold image
- @param x The x-coordinate of the starting pixel
- @param y The y-coordinate of the starting pixel
- @param region_array Array storing region data
- @param region_number Pointer to the current region number
+ @brief Frees a detection list
+ @param detections The detection list
  */
-void depth_first_search(Bmp* threshold_image, int x, int y, Region region_array[], int* region_number);
+void free_detection_list(DetectionList* detections);
 
 /**
- @brief Finds connected regions in a thresholded image using depth first search.
- @param threshold_image The thresholded image
- @param image_bmp The original image bitmap
- @param data Array storing calibration data
- @param num_calibrations Number of calibrations loaded
+ @brief Lists the regions big enough to report, grouped by object type in calibration order
+ (scan order within each type), drawing their boxes on an image if one is given
+ 
+ Every mode that reports detections goes through this, so they all report
+ them in the same order.
+ @param store The calibration store naming each object type
+ @param regions Table of detected regions, each classified by its dominant object type
+ @param image_with_boxes Image to draw the boxes on (NULL to draw nothing)
+ @param detections Receives the reported regions (its buffer is reused)
+ @return Number of regions reported
  */
-void find_connected_regions(Bmp threshold_image, Bmp image_bmp, char* data[MAX_CALIBRATIONS][LEN_CALIBRATION_DATA], int num_calibrations);
+int collect_detections(const CalibrationStore* store, const RegionTable* regions, Bmp* image_with_boxes, DetectionList* detections);
+
+/**
+ @brief Prints a "Detected" line (name, x, y, width and height) for each reported region
+ @param store The calibration store naming each object type
+ @param detections Regions listed by collect_detections()
+ */
+void print_detections(const CalibrationStore* store, const DetectionList* detections);
 
 /**
  @brief Detects objects in an image using calibration data and outputs detected objects
  @param calibration_file_path Path to the calibration file
  @param image_file_path Path to the image file to detect objects
+ @param num_threads Number of threads to threshold and label with
+ @param show_timing Print the time each stage took, and the centroid of each detection, to stderr as JSON (thresholding and labelling then run as separate passes)
+ */
+void detection_mode(char* calibration_file_path, char* image_file_path, int num_threads, int show_timing);
+
+/**
+ @brief Reads the options following the image of detect mode, exiting on invalid input
+ @param argc Number of arguments
+ @param argv The arguments
+ @param num_threads Receives the thread count if THREADS_OPTION is given
+ @param show_timing Set to 1 if TIMING_OPTION is given
+ */
+void parse_detect_options(int argc, char** argv, int* num_threads, int* show_timing);
+
+/**
+ @brief Reads the options following the calibration file of bench mode, exiting on invalid input
+ @param argc Number of arguments
+ @param argv The arguments
+ @param num_threads Receives the thread count if THREADS_OPTION is given
+ @param iterations Receives the number of timed runs if ITERATIONS_OPTION is given
+ */
+void parse_bench_options(int argc, char** argv, int* num_threads, int* iterations);
+
+/**
+ @brief Reads a whole number argument, exiting on invalid input
+ @param value The argument
+ @param min Smallest number allowed
+ @param max Largest number allowed
+ @return The number
+ */
+long parse_number(char* value, long min, long max);
+
+/**
+ @brief Reads the thread count option of detect mode, exiting on invalid input
+ @param option The option argument (must be THREADS_OPTION)
+ @param value The thread count argument
+ @return Number of threads (1 to MAX_THREADS)
+ */
+int parse_thread_count(char* option, char* value);
+
+/**
+ @brief Collects the paths of every .bmp file in a directory, sorted by name
+ @param directory_path Path to the directory
+ @param image_paths Receives an allocated array of allocated paths (free with free_path_list)
+ @return Number of paths found
+ */
+int list_bmp_files(char* directory_path, char*** image_paths);
+
+/**
+ @brief Collects the image paths listed in a text file, one per line (blank lines are skipped)
+ @param list_path Path to the text file
+ @param image_paths Receives an allocated array of allocated paths (free with free_path_list)
+ @return Number of paths read
+ */
+int read_path_list(char* list_path, char*** image_paths);
+
+/**
+ @brief Frees a list of paths
+ @param image_paths Array from list_bmp_files or read_path_list (may be NULL)
+ @param num_images Number of paths in the array
  */
-void detection_mode(char* calibration_file_path, char* image_file_path);
+void free_path_list(char** image_paths, int num_images);
 
 /**
- @brief Calibrates an object based on an image and writes calibration data to a file
- @param calibration_file_name Path to the calibration file
+ @brief Checks the SIMD and lookup table threshold kernels against rgb2hsv, exiting with 1 on a mismatch
+ @param calibration_file_path Path to the calibration file
+ @param image_paths Images to check (every image in DEFAULT_IMAGE_DIRECTORY when num_images is 0)
+ @param num_images Number of images given
+ */
+void self_check_mode(char* calibration_file_path, char* image_paths[], int num_images);
+
+/**
+ @brief Detects objects in a sequence of images, printing one line per frame
+ 
+ The calibration, threads and working buffers are kept from one frame to the
+ next, and the next frame is read on its own thread while one is detected.
+ Each line holds the frame index, its source, the number of detections and
+ then the object name, x, y, width and height of each detection.
+ @param calibration_file_path Path to the calibration file
+ @param source A directory of images, a single .bmp file, a text file listing images or STDIN_SOURCE for concatenated images on stdin
+ @param num_threads Number of threads to threshold and label with
+ @param output_directory Directory to save each frame with its boxes to (NULL to save nothing)
+ */
+void batch_mode(char* calibration_file_path, char* source, int num_threads, char* output_directory);
+
+/**
+ @brief Detects objects in a sequence of images, redoing only the tiles that changed since the previous frame
+ 
+ Each frame prints a "Frame" line (its index, source, whether it was fully
+ recomputed and how many tiles changed) followed by the same "Detected" lines
+ as detect mode. The results are identical to detecting every frame in full.
+ @param calibration_file_path Path to the calibration file
+ @param source A directory of images, a single .bmp file, a text file listing images or STDIN_SOURCE for concatenated images on stdin
+ @param num_threads Number of threads to threshold and label with
+ @param output_directory Directory to save each frame with its boxes to (NULL to save nothing)
+ @param full_interval Recompute the whole frame every this many frames (0 for only the first frame and size changes)
+ */
+void temporal_mode(char* calibration_file_path, char* source, int num_threads, char* output_directory, int full_interval);
+
+/**
+ @brief Reads the options following the source of batch and temporal mode, exiting on invalid input
+ @param argc Number of arguments
+ @param argv The arguments
+ @param num_threads Receives the thread count if THREADS_OPTION is given
+ @param output_directory Receives the output directory if OUTPUT_OPTION is given
+ @param full_interval Receives the full recompute interval if FULL_INTERVAL_OPTION is given, or NULL to reject the option
+ */
+void parse_sequence_options(int argc, char** argv, int* num_threads, char** output_directory, int* full_interval);
+
+/**
+ @brief Calibrates the hue window of an object from the middle of an image
  @param image_file_path Path to the image file to use for calibration
+ @return The hue window of the saturated, bright pixels in the middle WINDOW_SIZE square
+ */
+HueRange calibrate_image(char* image_file_path);
+
+/**
+ @brief Calibrates objects from images in parallel, printing a calibration line for each
+ 
+ With a store, each object is appended to it, or gains another hue range if
+ the store already has an object of that name. The store keeps its format
+ (text or compiled), and a new one is written compiled.
+ @param arguments Object names and image paths, alternating
+ @param num_images Number of name and image pairs
+ @param num_threads Number of images to calibrate at once
+ @param store_path Calibration store to append to (NULL to only print the lines)
+ */
+void calibration_mode(char** arguments, int num_images, int num_threads, char* store_path);
+
+/**
+ @brief Reads the name and image pairs and the options of calibration mode, exiting on invalid input
+ @param argc Number of arguments
+ @param argv The arguments
+ @param num_images Receives the number of name and image pairs (they start at argv[2])
+ @param num_threads Receives the thread count if THREADS_OPTION is given
+ @param store_path Receives the calibration store if APPEND_OPTION is given
+ */
+void parse_calibration_options(int argc, char** argv, int* num_images, int* num_threads, char** store_path);
+
+/**
+ @brief Compiles a calibration file into a store file that later runs map instead of parsing
+ @param calibration_file_path Path to the text calibration file (or another compiled store)
+ @param store_path Path to write the compiled store to
  */
-void calibration_mode(char* calibration_file_name, char* image_file_path);
+void compile_mode(char* calibration_file_path, char* store_path);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef _COLOUR_LUT_H
+#define _COLOUR_LUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bitmap.h"
+
+#define LUT_NONE 0xFFFF             ///< Label for colours that match no calibration
+#define LUT_ENTRIES (1 << 24)       ///< One entry for every packed 24-bit RGB colour
+#define LUT_MAGIC "CAMLUT03"        ///< Identifies a cached lookup table file (8 bytes)
+#define LUT_MAGIC_LENGTH 8          ///< Length of LUT_MAGIC without the terminator
+#define LUT_CACHE_SUFFIX ".lut"     ///< Appended to the calibration file path to name the cache
+#define HUE_RANGE 361               ///< Number of possible hue values returned by rgb2hsv (0-360)
+
+// Calibrated objects with their hue-bucket index (see calibration_store.h)
+typedef struct CalibrationStore CalibrationStore;
+
+// Colour lookup table mapping every packed RGB colour straight to the
+// first calibration it matches, or LUT_NONE
+typedef struct {
+    uint16_t* labels;       ///< LUT_ENTRIES labels indexed with pack_rgb()
+    uint64_t key;           ///< Hash of the calibration file the table was built from
+    void* mapping;          ///< Cache file mapping holding labels (NULL if allocated)
+    size_t mapping_size;    ///< Size of the cache file mapping
+} ColourLut;
+
+/**
+ @brief Packs the colour bytes of a pixel into a 24-bit lookup table index
+ @param pixel Pointer to the 3 colour bytes of a pixel
+ @return (red << 16) | (green << 8) | blue
+ */
+static inline uint32_t pack_rgb(const unsigned char* pixel) {
+    return ((uint32_t)pixel[RED] << 16) | ((uint32_t)pixel[GREEN] << 8) | pixel[BLUE];
+}
+
+/**
+ @brief Hashes the contents of a calibration file together with the table format
+ @param calibration_file_path Path to the calibration file
+ @return 64-bit FNV-1a hash used as the cache key
+ */
+uint64_t hash_calibration_file(char* calibration_file_path);
+
+/**
+ @brief Builds the colour lookup table for the objects of a calibration store
+ @param store The calibration store
+ @return The lookup table (key left as 0)
+ */
+ColourLut build_colour_lut(const CalibrationStore* store);
+
+/**
+ @brief Loads the cached lookup table for a calibration file, building and caching it if needed
+ @param calibration_file_path Path to the calibration file
+ @param store The calibration store loaded from that file
+ @return The lookup table
+ */
+ColourLut load_colour_lut(char* calibration_file_path, const CalibrationStore* store);
+
+/**
+ @brief Frees (or unmaps) a lookup table
+ @param lut The lookup table to free
+ */
+void free_colour_lut(ColourLut lut);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _FRAME_QUEUE_H
+#define _FRAME_QUEUE_H
+
+#include "bitmap.h"
+
+// One image waiting to be processed
+typedef struct {
+    Bmp image;          ///< The image (owned by whoever pops it)
+    int index;          ///< Position of the frame in the sequence
+    char* name;         ///< Where the frame came from (not owned by the frame)
+} Frame;
+
+// Bounded first-in first-out queue handing frames from a reader thread to the detector
+typedef struct FrameQueue FrameQueue;
+
+/**
+ @brief Creates an empty frame queue
+ @param capacity Maximum number of frames waiting at once (pushing blocks while it is full)
+ @return The frame queue
+ */
+FrameQueue* create_frame_queue(int capacity);
+
+/**
+ @brief Adds a frame to the back of the queue, waiting while it is full
+ @param queue The frame queue
+ @param frame The frame
+ */
+void push_frame(FrameQueue* queue, Frame frame);
+
+/**
+ @brief Takes the frame at the front of the queue, waiting while it is empty
+ @param queue The frame queue
+ @param frame Receives the frame
+ @return 1 if a frame was taken, 0 once the queue is closed and empty
+ */
+int pop_frame(FrameQueue* queue, Frame* frame);
+
+/**
+ @brief Marks the end of the frames; pop_frame returns 0 once the rest are taken
+ @param queue The frame queue
+ */
+void close_frame_queue(FrameQueue* queue);
+
+/**
+ @brief Frees a frame queue and any frames still waiting in it
+ @param queue The frame queue
+ */
+void free_frame_queue(FrameQueue* queue);
+
+#endif
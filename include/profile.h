@@ -0,0 +1,83 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdio.h>
+
+// Stages of detecting objects in one frame
+typedef enum {
+    STAGE_READ,         ///< Reading the image
+    STAGE_THRESHOLD,    ///< Classifying every pixel
+    STAGE_LABEL,        ///< Grouping matched pixels into regions
+    STAGE_CLASSIFY,     ///< Picking and boxing the regions to report
+    STAGE_WRITE,        ///< Writing the output images
+    NUM_STAGES
+} Stage;
+
+// Time each stage took, one sample per frame
+typedef struct {
+    double* samples;    ///< NUM_STAGES seconds per frame, frame by frame
+    int count;          ///< Frames recorded
+    int capacity;       ///< Frames allocated
+} StageTimes;
+
+/**
+ @brief Returns a monotonic time in seconds, for measuring how long something takes
+ @return Seconds since an arbitrary point
+ */
+double clock_seconds(void);
+
+/**
+ @brief Creates an empty set of stage times
+ @param num_frames Number of frames to make room for up front (more still fit)
+ @return The stage times
+ */
+StageTimes create_stage_times(int num_frames);
+
+/**
+ @brief Frees a set of stage times
+ @param times The stage times
+ */
+void free_stage_times(StageTimes* times);
+
+/**
+ @brief Starts recording a new frame, with every stage at zero
+ @param times The stage times (NULL when timing is off)
+ */
+void start_frame_times(StageTimes* times);
+
+/**
+ @brief Adds time to a stage of the frame being recorded
+ @param times The stage times (NULL when timing is off)
+ @param stage The stage
+ @param seconds Time the stage took
+ */
+void record_stage(StageTimes* times, Stage stage, double seconds);
+
+/**
+ @brief Prints the latency percentiles (in milliseconds) and throughput of each stage and of whole frames as a JSON object
+ @param stream Where to print
+ @param times The stage times
+ @param megapixels Megapixels in each frame (for the throughput)
+ */
+void print_stage_json(FILE* stream, const StageTimes* times, double megapixels);
+
+/**
+ @brief Prints a string as a quoted JSON string, escaping quotes, backslashes and control characters
+ @param stream Where to print
+ @param text The string (such as a file path)
+ */
+void print_json_string(FILE* stream, const char* text);
+
+/**
+ @brief Returns the largest resident set size the process has reached
+ @return Peak resident set size in kilobytes
+ */
+long peak_rss_kb(void);
+
+/**
+ @brief Returns the number of malloc, calloc, realloc and aligned_alloc calls made by the program's own code so far
+ @return Number of allocations
+ */
+unsigned long allocation_count(void);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _REGIONS_H
+#define _REGIONS_H
+
+#include "bitmap.h"
+#include "threshold.h"
+#include "thread_pool.h"
+
+#define NO_REGION 0             ///< Label of background pixels in the region plane
+#define INITIAL_REGIONS 64      ///< Starting capacity of a region table (it grows as needed)
+
+// Region structure to define the bounding box and statistics of detected objects
+typedef struct {
+    int min_x;          ///< Minimum x-coordinate of the region
+    int max_x;          ///< Maximum x-coordinate of the region
+    int min_y;          ///< Minimum y-coordinate of the region
+    int max_y;          ///< Maximum y-coordinate of the region
+    long area;          ///< Number of pixels in the region
+    long sum_x;         ///< Sum of the x-coordinates of its pixels (for the centroid)
+    long sum_y;         ///< Sum of the y-coordinates of its pixels (for the centroid)
+    int first_x;        ///< x-coordinate of its first pixel in scan order (on row min_y)
+    int object_type;    ///< Most common object type among its pixels
+} Region;
+
+// Number of pixels of one object type in one region
+typedef struct {
+    unsigned int region;        ///< Region label (NO_REGION marks an empty slot)
+    unsigned int object_type;   ///< Object type counted
+    unsigned int count;         ///< Pixels of that type in the region
+} TypeCount;
+
+// Open-addressing hash of the (region, object type) pairs that occur, so
+// counting takes space for the pairs present rather than for every type
+typedef struct {
+    TypeCount* slots;           ///< Slots, a power of two of them
+    unsigned int capacity;      ///< Slots allocated
+    unsigned int used;          ///< Slots holding a pair
+} TypeCountTable;
+
+// Union-find labels handed out while scanning one band of rows
+typedef struct {
+    unsigned int* parent;       ///< Union-find parent of each provisional label
+    Region* provisional;        ///< Statistics gathered per provisional label
+    unsigned int count;         ///< Provisional labels handed out (label 0 is unused)
+    unsigned int capacity;      ///< Provisional labels allocated
+    TypeCountTable type_counts; ///< Object type counts of the band's pixels
+} LabelScratch;
+
+// Growable table of the regions found in an image, plus the union-find
+// working buffers used to label them (kept so they can be reused)
+typedef struct {
+    Region* regions;            ///< Regions found, region label k is regions[k - 1]
+    int count;                  ///< Number of regions found
+    int capacity;               ///< Number of regions allocated
+    TypeCountTable type_counts; ///< Object type counts of all the bands added together
+
+    LabelScratch* bands;        ///< Provisional labels of each band of rows
+    int num_bands;              ///< Number of bands allocated
+    unsigned int* band_offsets; ///< First global label of each band, minus one
+    unsigned int* parent;       ///< Union-find parent of each global provisional label
+    unsigned int* final_label;  ///< Region label each global provisional label resolves to
+    unsigned int global_capacity;   ///< Global provisional labels allocated
+} RegionTable;
+
+/**
+ @brief Creates an empty region table
+ @return The region table
+ */
+RegionTable create_region_table(void);
+
+/**
+ @brief Empties a region table so it can be reused, keeping its buffers
+ @param table The region table
+ */
+void reset_region_table(RegionTable* table);
+
+/**
+ @brief Frees a region table
+ @param table The region table
+ */
+void free_region_table(RegionTable* table);
+
+/**
+ @brief Computes the centroid of a region
+ @param region The region
+ @param x Receives the mean x-coordinate of its pixels
+ @param y Receives the mean y-coordinate of its pixels
+ */
+void region_centroid(const Region* region, double* x, double* y);
+
+/**
+ @brief Thresholds an image and labels its 4-connected white regions with a two-pass
+ union-find scan, splitting the rows into one band per thread
+ 
+ Each band is thresholded and labelled on its own, then the labels touching
+ across band edges are joined. Regions are numbered by their first pixel in
+ scan order, and they and their statistics are the same whatever the number
+ of threads.
+ @param pool Threads to use (NULL for the calling thread only)
+ @param engine Threshold engine used to classify the pixels (NULL if threshold_image is already thresholded)
+ @param image_bmp The original image bitmap
+ @param threshold_image Receives the threshold mask, object types and region labels (same size as image_bmp, NO_REGION for background)
+ @param table Receives every region with its bounding box, area, centroid sums and dominant object type
+ @return Number of regions found
+ */
+int threshold_and_label(ThreadPool* pool, const ThresholdEngine* engine, Bmp image_bmp, Bmp threshold_image, RegionTable* table);
+
+/**
+ @brief Labels the white pixels of a window that are not in a region yet (NO_REGION in the region plane)
+ 
+ Pixels already in a region are treated as background, and the region plane
+ is left unchanged. Regions are numbered in scan order as threshold_and_label() does.
+ @param pool Threads to use (NULL for the calling thread only)
+ @param threshold_image The threshold image
+ @param min_x Left column of the window
+ @param min_y First row of the window
+ @param max_x Right column of the window (inclusive)
+ @param max_y Last row of the window (inclusive)
+ @param window_labels Receives the region label of each window pixel, row by row (window width * window height values)
+ @param table Receives every region found in the window
+ @return Number of regions found
+ */
+int label_window(ThreadPool* pool, Bmp threshold_image, int min_x, int min_y, int max_x, int max_y, unsigned int* window_labels, RegionTable* table);
+
+#endif
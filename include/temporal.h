@@ -0,0 +1,67 @@
+#ifndef _TEMPORAL_H
+#define _TEMPORAL_H
+
+#include "bitmap.h"
+#include "threshold.h"
+#include "regions.h"
+#include "thread_pool.h"
+
+#define TILE_SIZE 32            ///< Width and height of the tiles compared between frames
+
+// Everything kept from one frame to the next so only the tiles that changed are redone
+typedef struct {
+    Bmp previous;               ///< Copy of the last frame's pixels, updated tile by tile
+    Bmp threshold_image;        ///< Mask, object types and region ids of the last frame
+    int num_frames;             ///< Frames detected so far
+    int full_interval;          ///< Recompute the whole frame every this many frames (0 for only when needed)
+
+    Region* regions;            ///< Statistics of each region id (region id k is regions[k - 1])
+    unsigned char* active;      ///< Whether each region id is in use (indexed by id)
+    unsigned char* affected;    ///< Whether each region id touches a changed tile (indexed by id)
+    unsigned int* free_ids;     ///< Region ids available for reuse
+    unsigned int num_free;      ///< Number of region ids available for reuse
+    unsigned int num_ids;       ///< Highest region id handed out
+    unsigned int id_capacity;   ///< Region ids allocated
+
+    unsigned char* dirty;       ///< Tiles whose pixels changed this frame
+    unsigned char* near_dirty;  ///< Tiles that changed or touch one that did
+    int tiles_x;                ///< Tiles across a frame
+    int tiles_y;                ///< Tiles down a frame
+    int num_dirty;              ///< Tiles that changed this frame
+
+    RegionTable window_regions; ///< Regions found when labelling (the whole frame or a window of it)
+    unsigned int* window_labels;    ///< Labels of the window being relabelled
+    size_t window_capacity;     ///< Window labels allocated
+    unsigned int* new_ids;      ///< Region id given to each region of window_regions
+    int new_ids_capacity;       ///< Region ids allocated in new_ids
+
+    RegionTable detections;     ///< Regions of the current frame in scan order (only regions and count are used)
+} TemporalState;
+
+/**
+ @brief Creates the state of an empty sequence of frames
+ @param full_interval Recompute the whole frame every this many frames (0 for only when the size changes)
+ @return The temporal state
+ */
+TemporalState create_temporal_state(int full_interval);
+
+/**
+ @brief Detects the regions of the next frame, redoing only tiles that changed and their neighbours
+ 
+ Regions are identical to thresholding and labelling the whole frame, and
+ state->detections lists them in the same scan order.
+ @param state The temporal state
+ @param pool Threads to use (NULL for the calling thread only)
+ @param engine Threshold engine built from the calibration data
+ @param frame The frame (left unchanged)
+ @return 1 if the whole frame was recomputed, 0 if only the changed tiles were
+ */
+int detect_next_frame(TemporalState* state, ThreadPool* pool, const ThresholdEngine* engine, Bmp frame);
+
+/**
+ @brief Frees the state of a sequence of frames
+ @param state The temporal state
+ */
+void free_temporal_state(TemporalState* state);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+/**
+ @brief Work done for one task of a parallel job
+ @param argument The argument given to run_parallel
+ @param task Index of the task (0 to num_tasks - 1)
+ */
+typedef void (*TaskFunction)(void* argument, int task);
+
+// Fixed set of worker threads that run the tasks of one job at a time
+typedef struct ThreadPool ThreadPool;
+
+/**
+ @brief Starts a thread pool
+ @param num_threads Total threads working on each job, including the caller of run_parallel
+ @return The thread pool
+ */
+ThreadPool* create_thread_pool(int num_threads);
+
+/**
+ @brief Returns the number of threads working on each job
+ @param pool The thread pool (NULL counts as a single thread)
+ @return Number of threads
+ */
+int thread_pool_size(const ThreadPool* pool);
+
+/**
+ @brief Runs every task of a job across the pool and waits for all of them to finish
+ @param pool The thread pool (NULL runs the tasks on the calling thread)
+ @param num_tasks Number of tasks
+ @param function Function run once per task
+ @param argument Argument passed to every task
+ */
+void run_parallel(ThreadPool* pool, int num_tasks, TaskFunction function, void* argument);
+
+/**
+ @brief Stops the worker threads and frees the pool
+ @param pool The thread pool (may be NULL)
+ */
+void free_thread_pool(ThreadPool* pool);
+
+/**
+ @brief Returns the number of processors online, used as the default thread count
+ @return Number of processors (at least 1)
+ */
+int default_thread_count(void);
+
+#endif
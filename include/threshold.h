@@ -0,0 +1,148 @@
+#ifndef _THRESHOLD_H
+#define _THRESHOLD_H
+
+#include "bitmap.h"
+#include "colour_lut.h"
+#include "calibration_store.h"
+#include "thread_pool.h"
+
+#define SIMD_SSE41_PIXELS 16    ///< Pixels classified per SSE4.1 iteration
+#define SIMD_AVX2_PIXELS 32     ///< Pixels classified per AVX2 iteration
+#define MASK_MATCHED 0xFF       ///< Mask byte for a pixel matching a calibration (white)
+#define MASK_UNMATCHED 0x00     ///< Mask byte for a pixel matching nothing (black)
+#define HUE_ENTRY_LABEL_MASK 0xFFFF     ///< Bits of a hue entry holding the first object covering the hue
+#define HUE_ENTRY_SATURATION_SHIFT 16   ///< Bit offset of the saturation minimum (0-100) in a hue entry
+#define HUE_ENTRY_SATURATION_MASK 0x7F  ///< Bits of the saturation minimum, once shifted down
+#define HUE_ENTRY_CHANNEL_SHIFT 23      ///< Bit offset of the brightest channel minimum (0-255) in a hue entry
+#define HUE_ENTRY_CHANNEL_MASK 0xFF     ///< Bits of the brightest channel minimum, once shifted down
+#define HUE_ENTRY_MORE 0x80000000u      ///< Hue entry bit set when more objects than the first cover the hue
+
+// Ways of classifying a row of pixels, picked at runtime
+typedef enum {
+    KERNEL_AUTO,        ///< Best kernel the CPU supports
+    KERNEL_REFERENCE,   ///< rgb2hsv() and hue_difference() per pixel (used to check the others)
+    KERNEL_SCALAR,      ///< Colour lookup table, one pixel at a time
+    KERNEL_SSE41,       ///< SSE4.1, 16 pixels at a time
+    KERNEL_AVX2         ///< AVX2, 32 pixels at a time
+} ThresholdKernelType;
+
+typedef struct ThresholdEngine ThresholdEngine;
+
+/**
+ @brief Classifies one row of pixels
+ @param engine The engine holding the calibrated objects
+ @param pixels The row of BGR source pixels
+ @param width Number of pixels in the row
+ @param object_type Receives the matched calibration of each pixel (0 where nothing matched)
+ @param mask_pixels Receives the BGR mask row (white where matched, black otherwise)
+ */
+typedef void (*ThresholdRowKernel)(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels);
+
+// Everything needed to classify pixels against the loaded calibrations
+struct ThresholdEngine {
+    ThresholdKernelType kernel_type;    ///< Kernel used by threshold_row
+    ThresholdRowKernel threshold_row;   ///< Classifies one row of pixels
+    const CalibrationStore* store;      ///< Calibrated objects and their hue-bucket index (not owned)
+    int num_calibrations;               ///< Number of calibrated objects
+    int min_saturation;                 ///< Smallest saturation minimum of any object
+    int min_max_channel;                ///< Smallest brightest channel (0-256) that passes any object's value minimum
+    uint32_t* hue_entries;              ///< HUE_RANGE entries packing the first object covering each hue with its minimums
+    ColourLut lut;                      ///< Colour lookup table (only loaded for KERNEL_SCALAR)
+};
+
+/**
+ @brief Writes the object type and mask of one classified pixel without branching
+ @param label The matched calibration, or LUT_NONE
+ @param x Column of the pixel in the row
+ @param object_type The row of object types (receives 0 where nothing matched)
+ @param mask_pixels The BGR mask row (receives white where matched, black otherwise)
+ */
+static inline void store_label(unsigned short label, int x, unsigned short* object_type, unsigned char* mask_pixels) {
+    unsigned char mask = (label != LUT_NONE) ? MASK_MATCHED : MASK_UNMATCHED;
+    object_type[x] = label & (unsigned short)-(label != LUT_NONE);
+    mask_pixels[x * BYTES_PER_PIXEL + BLUE] = mask;
+    mask_pixels[x * BYTES_PER_PIXEL + GREEN] = mask;
+    mask_pixels[x * BYTES_PER_PIXEL + RED] = mask;
+}
+
+/**
+ @brief Returns the fastest kernel supported by the CPU running the program
+ @return KERNEL_AVX2, KERNEL_SSE41 or KERNEL_SCALAR
+ */
+ThresholdKernelType detect_threshold_kernel(void);
+
+/**
+ @brief Returns whether the CPU running the program can use a kernel
+ @param kernel_type The kernel to check
+ @return 1 if supported, 0 otherwise
+ */
+int threshold_kernel_supported(ThresholdKernelType kernel_type);
+
+/**
+ @brief Returns a printable name for a kernel
+ @param kernel_type The kernel
+ @return Name such as "avx2"
+ */
+const char* threshold_kernel_name(ThresholdKernelType kernel_type);
+
+/**
+ @brief Creates an engine that classifies pixels against the objects of a calibration store
+ @param calibration_file_path Calibration file the store came from (keys the lookup table cache)
+ @param store The calibration store (must outlive the engine)
+ @param kernel_type Kernel to use, or KERNEL_AUTO to pick the fastest supported one
+ @return The engine
+ */
+ThresholdEngine create_threshold_engine(char* calibration_file_path, const CalibrationStore* store, ThresholdKernelType kernel_type);
+
+/**
+ @brief Frees an engine created by create_threshold_engine
+ @param engine The engine to free
+ */
+void free_threshold_engine(ThresholdEngine engine);
+
+/**
+ @brief Thresholds every row of an image, one band of rows per thread
+ @param pool Threads to use (NULL for the calling thread only)
+ @param engine The engine to classify the pixels with
+ @param image_bmp The original image bitmap
+ @param threshold_image Receives the threshold mask and object types (same size as image_bmp)
+ */
+void threshold_rows(ThreadPool* pool, const ThresholdEngine* engine, Bmp image_bmp, Bmp threshold_image);
+
+/**
+ @brief Classifies a single pixel with rgb2hsv(), testing every object in turn like the original per-calibration loop
+ @param engine The engine holding the calibrated objects
+ @param pixel Pointer to the 3 colour bytes of the pixel
+ @return The first matching object, or LUT_NONE
+ */
+unsigned short classify_pixel(const ThresholdEngine* engine, const unsigned char* pixel);
+
+/**
+ @brief Classifies a single pixel with rgb2hsv(), testing only the objects in the hue bucket of its hue
+ @param engine The engine holding the calibrated objects
+ @param pixel Pointer to the 3 colour bytes of the pixel
+ @return The first matching object, or LUT_NONE (always the same as classify_pixel)
+ */
+unsigned short lookup_pixel(const ThresholdEngine* engine, const unsigned char* pixel);
+
+/**
+ @brief SSE4.1 row kernel (only call when threshold_kernel_supported(KERNEL_SSE41))
+ */
+void threshold_row_sse41(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels);
+
+/**
+ @brief AVX2 row kernel (only call when threshold_kernel_supported(KERNEL_AVX2))
+ */
+void threshold_row_avx2(const ThresholdEngine* engine, const unsigned char* pixels, int width, unsigned short* object_type, unsigned char* mask_pixels);
+
+/**
+ @brief Checks every kernel the CPU supports against KERNEL_REFERENCE, bit for bit
+ @param calibration_file_path Path to the calibration file
+ @param store The calibration store loaded from it
+ @param image_paths Images to check
+ @param num_images Number of images to check
+ @return Number of mismatching kernel runs (0 when everything matches)
+ */
+int threshold_self_check(char* calibration_file_path, const CalibrationStore* store, char** image_paths, int num_images);
+
+#endif